@@ -0,0 +1,325 @@
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/BranchProbability.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+    Threshold("coldblocksna-threshold", cl::init(1),
+              cl::desc("Largest percentage of the iterations of a loop "
+                       "in which a block of the loop is cold"));
+
+static cl::opt<bool>
+    Outline("coldblocksna-outline", cl::init(false),
+            cl::desc("Outline the cold regions of loops into cold "
+                     "functions instead of only moving them"));
+
+static cl::opt<unsigned>
+    OutlineSize("coldblocksna-outline-size", cl::init(8),
+                cl::desc("Smallest number of instructions of a cold "
+                         "region that is outlined"));
+
+namespace {
+// The cold blocks of a loop and what was done with them
+struct ColdLoop {
+  Loop *L;
+  SmallVector<BasicBlock *, 8> Blocks;
+  unsigned Moved = 0;
+  unsigned Instructions = 0;
+  SmallVector<Function *, 2> Outlined;
+};
+
+class ColdBlocksNA : public ModulePass {
+public:
+  static char ID;
+
+  ColdBlocksNA();
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+  bool runOnModule(Module &M) override;
+
+private:
+  // Find the cold blocks of every loop of a function: the blocks of
+  // the loop, outside its subloops, that run in at most Threshold
+  // percent of its iterations, and its cold exit blocks that end the
+  // program, e.g. on an error
+  void findColdBlocks(LoopInfo &LI, BlockFrequencyInfo &BFI,
+                      SmallVectorImpl<ColdLoop> &Loops) const;
+
+  // Check if a block runs in at most Threshold percent of the
+  // iterations of a loop
+  bool isCold(const BasicBlock &BB, const Loop &L,
+              BlockFrequencyInfo &BFI) const;
+
+  // Outline the single-entry regions of the cold blocks of a loop into
+  // cold functions, leaving the blocks that could not be outlined
+  bool outlineColdBlocks(Function &F, ColdLoop &Cold,
+                         BlockFrequencyInfo &BFI, BranchProbabilityInfo &BPI,
+                         const CodeExtractorAnalysisCache &CEAC) const;
+
+  // Move the cold blocks of the loops after the last block of the
+  // function, keeping their order, so that the hot blocks of each loop
+  // are laid out contiguously
+  bool moveColdBlocks(Function &F, MutableArrayRef<ColdLoop> Loops) const;
+
+  // Print what was done with the cold blocks of every loop
+  void print(const Function &F, ArrayRef<ColdLoop> Loops) const;
+
+  // Emit an optimization remark for every loop whose cold blocks were
+  // moved or outlined so that they can be collected with
+  // -pass-remarks-output
+  void emitRemarks(const Function &F, ArrayRef<ColdLoop> Loops) const;
+}; // end of class ColdBlocksNA
+
+} // end of anonymous namespace
+
+char ColdBlocksNA::ID = 0;
+
+static RegisterPass<ColdBlocksNA> X("ColdBlocksNA", "ColdBlocksNA Pass",
+                                    false /* Only looks at CFG */,
+                                    false /* Analysis Pass */);
+
+ColdBlocksNA::ColdBlocksNA() : ModulePass(ID) {
+  if (Threshold > 100) {
+    report_fatal_error("ColdBlocksNA: the threshold must be a percentage",
+                       false);
+  }
+}
+
+void ColdBlocksNA::getAnalysisUsage(AnalysisUsage &AU) const {
+  if (!Outline) {
+    AU.setPreservesCFG();
+  }
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<BlockFrequencyInfoWrapperPass>();
+  AU.addRequired<BranchProbabilityInfoWrapperPass>();
+}
+
+bool ColdBlocksNA::runOnModule(Module &M) {
+  // Outlined functions are added to the module, and are cold anyway
+  SmallVector<Function *, 16> Functions;
+  for (Function &F : M) {
+    if (!F.isDeclaration() && !F.hasOptNone() &&
+        !F.hasFnAttribute(Attribute::Cold)) {
+      Functions.push_back(&F);
+    }
+  }
+
+  bool Modified = false;
+  for (Function *F : Functions) {
+    // Each of these runs the function analyses again, the loops are
+    // only looked at once all of them are there
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(*F).getLoopInfo();
+    BlockFrequencyInfo &BFI =
+        getAnalysis<BlockFrequencyInfoWrapperPass>(*F).getBFI();
+    BranchProbabilityInfo &BPI =
+        getAnalysis<BranchProbabilityInfoWrapperPass>(*F).getBPI();
+    if (LI.empty()) {
+      continue;
+    }
+
+    SmallVector<ColdLoop, 8> Loops;
+    findColdBlocks(LI, BFI, Loops);
+    if (Loops.empty()) {
+      continue;
+    }
+
+    if (Outline) {
+      CodeExtractorAnalysisCache CEAC(*F);
+      for (ColdLoop &Cold : Loops) {
+        Modified |= outlineColdBlocks(*F, Cold, BFI, BPI, CEAC);
+      }
+    }
+    Modified |= moveColdBlocks(*F, Loops);
+    print(*F, Loops);
+    emitRemarks(*F, Loops);
+  }
+
+  return Modified;
+}
+
+void ColdBlocksNA::findColdBlocks(LoopInfo &LI, BlockFrequencyInfo &BFI,
+                                  SmallVectorImpl<ColdLoop> &Loops) const {
+  for (Loop *L : LI.getLoopsInPreorder()) {
+    // Nothing is colder than a loop that never runs
+    if (BFI.getBlockFreq(L->getHeader()).getFrequency() == 0) {
+      continue;
+    }
+
+    ColdLoop Cold = {L};
+    for (BasicBlock *BB : L->blocks()) {
+      if (BB != L->getHeader() && LI.getLoopFor(BB) == L &&
+          isCold(*BB, *L, BFI)) {
+        Cold.Blocks.push_back(BB);
+      }
+    }
+
+    SmallVector<BasicBlock *, 4> Exits;
+    L->getUniqueExitBlocks(Exits);
+    for (BasicBlock *BB : Exits) {
+      if (isa<UnreachableInst>(BB->getTerminator()) && isCold(*BB, *L, BFI)) {
+        Cold.Blocks.push_back(BB);
+      }
+    }
+
+    Loops.push_back(std::move(Cold));
+  }
+
+  // An exit block of a subloop can be one of the loop as well, it
+  // belongs to the innermost one
+  SmallPtrSet<BasicBlock *, 16> Seen;
+  for (ColdLoop &Cold : reverse(Loops)) {
+    erase_if(Cold.Blocks,
+             [&](BasicBlock *BB) { return !Seen.insert(BB).second; });
+  }
+  erase_if(Loops, [](const ColdLoop &Cold) { return Cold.Blocks.empty(); });
+}
+
+bool ColdBlocksNA::isCold(const BasicBlock &BB, const Loop &L,
+                          BlockFrequencyInfo &BFI) const {
+  return BFI.getBlockFreq(&BB) <=
+         BFI.getBlockFreq(L.getHeader()) * BranchProbability(Threshold, 100);
+}
+
+bool ColdBlocksNA::outlineColdBlocks(
+    Function &F, ColdLoop &Cold, BlockFrequencyInfo &BFI,
+    BranchProbabilityInfo &BPI, const CodeExtractorAnalysisCache &CEAC) const {
+  // The regions are the cold blocks dominated by a cold block whose
+  // immediate dominator is not cold
+  DominatorTree DT(F);
+  SmallPtrSet<BasicBlock *, 8> ColdSet(Cold.Blocks.begin(),
+                                        Cold.Blocks.end());
+  SmallPtrSet<BasicBlock *, 8> Taken;
+  SmallVector<SmallVector<BasicBlock *, 8>, 2> Regions;
+  for (BasicBlock *Entry : Cold.Blocks) {
+    DomTreeNode *IDom = DT.getNode(Entry)->getIDom();
+    if (Taken.count(Entry) || (IDom && ColdSet.count(IDom->getBlock()))) {
+      continue;
+    }
+
+    SmallVector<BasicBlock *, 8> Region = {Entry};
+    unsigned Size = Entry->size();
+    for (BasicBlock *BB : Cold.Blocks) {
+      if (BB != Entry && !Taken.count(BB) && DT.dominates(Entry, BB)) {
+        Region.push_back(BB);
+        Size += BB->size();
+      }
+    }
+    Taken.insert(Region.begin(), Region.end());
+    if (Size >= OutlineSize) {
+      Regions.push_back(std::move(Region));
+    }
+  }
+
+  bool Modified = false;
+  for (ArrayRef<BasicBlock *> Region : Regions) {
+    // Every extraction changes the CFG the next one is checked against
+    DominatorTree RegionDT(F);
+    CodeExtractor Extractor(Region, &RegionDT, false, &BFI, &BPI, nullptr,
+                            false, false, "cold");
+    if (!Extractor.isEligible()) {
+      continue;
+    }
+
+    Function *Outlined = Extractor.extractCodeRegion(CEAC);
+    if (!Outlined) {
+      continue;
+    }
+
+    Outlined->addFnAttr(Attribute::Cold);
+    Outlined->addFnAttr(Attribute::MinSize);
+    Cold.Outlined.push_back(Outlined);
+    for (BasicBlock *BB : Region) {
+      Cold.Instructions += BB->size();
+    }
+    erase_if(Cold.Blocks,
+             [&](BasicBlock *BB) { return is_contained(Region, BB); });
+
+    // The block calling the outlined function takes the place of the
+    // region, and is as cold
+    for (User *U : Outlined->users()) {
+      if (auto *CI = dyn_cast<CallInst>(U)) {
+        CI->setIsNoInline();
+        Cold.Blocks.push_back(CI->getParent());
+      }
+    }
+    Modified = true;
+  }
+
+  return Modified;
+}
+
+bool ColdBlocksNA::moveColdBlocks(Function &F,
+                                  MutableArrayRef<ColdLoop> Loops) const {
+  SmallPtrSet<BasicBlock *, 16> Moved;
+  for (ColdLoop &Cold : Loops) {
+    for (BasicBlock *BB : Cold.Blocks) {
+      Moved.insert(BB);
+      ++Cold.Moved;
+      Cold.Instructions += BB->size();
+    }
+  }
+
+  SmallVector<BasicBlock *, 16> Order;
+  for (BasicBlock &BB : F) {
+    if (Moved.count(&BB)) {
+      Order.push_back(&BB);
+    }
+  }
+  for (BasicBlock *BB : Order) {
+    BB->moveAfter(&F.back());
+  }
+
+  return !Order.empty();
+}
+
+void ColdBlocksNA::print(const Function &F, ArrayRef<ColdLoop> Loops) const {
+  for (const ColdLoop &Cold : Loops) {
+    if (!Cold.Moved && Cold.Outlined.empty()) {
+      continue;
+    }
+
+    errs() << F.getName() << ", loop " << Cold.L->getHeader()->getName()
+           << ": moved=" << Cold.Moved << ", outlined="
+           << Cold.Outlined.size() << ", instrs=" << Cold.Instructions;
+    for (const Function *Outlined : Cold.Outlined) {
+      errs() << ", " << Outlined->getName();
+    }
+    errs() << '\n';
+  }
+}
+
+void ColdBlocksNA::emitRemarks(const Function &F,
+                               ArrayRef<ColdLoop> Loops) const {
+  OptimizationRemarkEmitter ORE(&F);
+
+  for (const ColdLoop &Cold : Loops) {
+    if (!Cold.Moved && Cold.Outlined.empty()) {
+      continue;
+    }
+
+    ORE.emit([&]() {
+      return OptimizationRemark("ColdBlocksNA", "Cold", Cold.L->getStartLoc(),
+                                Cold.L->getHeader())
+             << "moved " << ore::NV("Moved", Cold.Moved)
+             << " cold blocks and outlined "
+             << ore::NV("Outlined", Cold.Outlined.size())
+             << " cold regions out of loop with header "
+             << ore::NV("Header", Cold.L->getHeader()->getName());
+    });
+  }
+}
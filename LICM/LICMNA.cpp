@@ -1,17 +1,91 @@
+#include "ModRefSummaryNA.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/InstructionSimplify.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
 #include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
 #include "llvm/Pass.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/CallPromotionUtils.h"
+#include "llvm/Transforms/Utils/Local.h"
+#include "llvm/Transforms/Utils/LoopPeel.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 using namespace llvm;
 
+static cl::opt<bool>
+    HoistAllocas("licmna-hoist-allocas", cl::init(true),
+                 cl::desc("Move fixed size allocas released every "
+                          "iteration to the entry block"));
+
+static cl::opt<bool>
+    HoistThreadLocals("licmna-hoist-tls", cl::init(false),
+                      cl::desc("Compute the addresses of thread local "
+                               "variables once in the preheader, for "
+                               "pipelines running no InstCombine after "
+                               "LICMNA"));
+
+static cl::opt<bool> ParallelAccesses(
+    "licmna-parallel-accesses", cl::init(true),
+    cl::desc("Hoist loads from invariant addresses out of loops whose "
+             "memory accesses are marked parallel"));
+
+static cl::opt<bool>
+    Peel("licmna-peel", cl::init(false),
+         cl::desc("Peel the first iteration of loops where that makes "
+                  "conditionally executed invariants hoistable"));
+
+static cl::opt<unsigned>
+    PeelBudget("licmna-peel-budget", cl::init(64),
+               cl::desc("Largest number of instructions of a loop that "
+                        "is peeled"));
+
+static cl::opt<bool>
+    WidenChecks("licmna-widen-checks", cl::init(false),
+                cl::desc("Replace the bounds checks of loops with one "
+                         "check in the preheader covering every "
+                         "iteration"));
+
+static cl::opt<bool>
+    ModRefSummaries("licmna-modref-summaries", cl::init(false),
+                    cl::desc("Look through the calls of a loop using "
+                             "the mod/ref summaries of their callees"));
+
+static cl::opt<bool>
+    HoistVirtualCalls("licmna-hoist-virtual-calls", cl::init(true),
+                      cl::desc("Hoist the vtable and function pointer "
+                               "loads of indirect calls"));
+
+static cl::opt<bool> Devirtualize(
+    "licmna-devirtualize", cl::init(false),
+    cl::desc("Compare the hoisted function pointer of an indirect call "
+             "with its likely target and call that one directly"));
+
 namespace {
 class LICMNA : public LoopPass {
 public:
@@ -22,11 +96,117 @@ public:
   bool runOnLoop(Loop *L, LPPassManager &LPM) override;
 
 private:
+  // Peel the first iteration of an innermost loop if a branch of the
+  // loop is decided from the second iteration on and an invariant
+  // cannot be hoisted yet, then fold the branches of the remaining
+  // iterations so that the invariants they guarded can be hoisted
+  bool peelFirstIteration(Loop *L);
+
+  // Check if a branch condition has the same value in every iteration
+  // but the first, and not a known one in all of them
+  bool isDecidedAfterFirstIteration(Loop *L, Value *Cond) const;
+
+  // Get the value of a branch condition if it is the same in every
+  // iteration
+  Optional<bool> getInvariantCondition(Loop *L, Value *Cond) const;
+
+  // Fold the branches of a peeled loop that no longer depend on the
+  // iteration and delete the blocks they made unreachable
+  void foldPeeledBranches(Loop *L);
+
+  // Replace the bounds checks of an innermost loop, i.e. the branches
+  // to a block that traps on a comparison of an induction variable with
+  // an invariant, with one check in the preheader covering every
+  // iteration. Every exit but the latch has to trap and every check has
+  // to run in every iteration, so that the loop traps either way.
+  bool widenChecks(Loop *L, SmallVectorImpl<Instruction *> &Instructions);
+
+  // Check if a block stops the program, e.g. with llvm.trap or a call
+  // reporting the error, using nothing computed in the loop
+  bool isTrapBlock(Loop *L, const BasicBlock &BB) const;
+
+  // Get the condition under which a bounds check passes in every
+  // iteration up to the exit count of the latch, expanded in the
+  // preheader, or null if it cannot be computed
+  Value *getWidenedCondition(Loop *L, const ICmpInst &Cmp, bool TrueInLoop,
+                             const SCEV *ExitCount, SCEVExpander &Expander,
+                             SmallVectorImpl<Instruction *> &Instructions);
+
   // Hoist all instructions to be hoisted and return true if the
   // number of instructions is greater than 0
   bool hoistInstructions(Loop *L,
                          SmallVectorImpl<Instruction *> &Instructions) const;
 
+  // Move the fixed size allocas that a stack restore releases before
+  // the next iteration to the entry block, and remove the stack saves
+  // and restores left with nothing to release
+  bool hoistAllocas(Loop *L,
+                    SmallVectorImpl<Instruction *> &Instructions) const;
+
+  // Check if every path from the alloca back to the loop header goes
+  // through a stack restore of the given stack save
+  bool isReleasedEachIteration(Loop *L, const AllocaInst &AI,
+                               const IntrinsicInst &Save) const;
+
+  // Remove the stack saves only used by stack restores, along with
+  // the restores, if the function has no dynamic allocas
+  bool removeStackSaves(Function &F,
+                        ArrayRef<IntrinsicInst *> Saves) const;
+
+  // Compute the addresses of the thread local variables used in the
+  // loop once in the preheader. The thread cannot change within the
+  // loop unless it is in a coroutine, which may be resumed by another
+  // one.
+  bool hoistThreadLocals(Loop *L,
+                         SmallVectorImpl<Instruction *> &Instructions) const;
+
+  // Get the instruction computing the address of a thread local
+  // variable in the preheader, creating it if needed. Addresses also
+  // holds the constant expressions on them made into instructions.
+  Instruction *
+  getThreadLocalAddress(GlobalVariable *GV, Instruction *Destination,
+                        DenseMap<Constant *, Instruction *> &Addresses,
+                        SmallVectorImpl<Instruction *> &Instructions) const;
+
+  // Hoist the loads of the function pointers of the indirect calls of
+  // the loop, along with the loads of the vtables they come from, if
+  // the memory they read is the same in every iteration
+  bool hoistVirtualCalls(Loop *L,
+                         SmallVectorImpl<Instruction *> &Instructions);
+
+  // Hoist a load along with the casts, GEPs and loads its address is
+  // computed with
+  bool hoistLoadChain(Loop *L, LoadInst *Load, Instruction *Destination,
+                      SmallVectorImpl<Instruction *> &Instructions) const;
+
+  // Check if a load reads the same memory in every iteration: it is
+  // marked invariant, it reads a vtable through a vtable pointer marked
+  // with !invariant.group, or no instruction of the loop may write it
+  bool isUnmodified(Loop *L, const LoadInst &Load) const;
+
+  // Check if a load can be hoisted because no instruction of the loop
+  // may write what it reads, with -licmna-modref-summaries
+  bool canHoistLoad(Loop *L, DominatorTree *DT, const Instruction &I) const;
+
+  // Get how an instruction may access a location, looking through the
+  // calls whose callees do not access it
+  ModRefInfo getModRefInfo(const Instruction &I,
+                           const MemoryLocation &Location) const;
+
+  // Check if an instruction may write memory other than the stack of
+  // the functions it calls
+  bool mayWriteToMemory(const Instruction &I) const;
+
+  // Get the function an indirect call most likely calls, from its
+  // !callees metadata or its value profile, or null if there is none
+  Function *getLikelyTarget(CallInst &CI) const;
+
+  // Call the likely target of an indirect call directly when the
+  // function pointer is equal to it, the comparison being done once in
+  // the preheader
+  bool devirtualize(Loop *L, CallInst *CI, Function *Target,
+                    SmallVectorImpl<Instruction *> &Instructions);
+
   // Check if a BasicBlock is contained in a subloop of the
   // given loop
   bool isInSubLoop(Loop *L, LoopInfo *LI, BasicBlock *BB) const;
@@ -45,11 +225,40 @@ private:
   // effects or domination of exit blocks
   bool safeToHoist(Loop *L, DominatorTree *DT, const Instruction &I) const;
 
-  // Check if an instruction dominates all the exit blocks of a loop
+  // Check if an instruction dominates all the exit blocks of a loop and
+  // runs whenever the loop is entered, nothing before it may keep the
+  // loop from reaching it
   bool dominatesExits(Loop *L, DominatorTree *DT, const Instruction &I) const;
 
+  // Check if an instruction runs in the first iteration whenever the
+  // loop is entered: its block is on every path through the iteration
+  // and nothing before it may not return
+  bool isGuaranteedToExecute(Loop *L, DominatorTree *DT,
+                             const Instruction &I) const;
+
+  // Check if a load from an invariant address can be hoisted out of a
+  // loop annotated with llvm.loop.parallel_accesses. No other iteration
+  // writes what it reads, so only the instructions before it in the
+  // same iteration are checked, without any alias query.
+  bool canHoistParallelLoad(Loop *L, DominatorTree *DT,
+                            const Instruction &I) const;
+
+  // Check if an instruction that may write to memory or not continue
+  // to the next one can run before the given one in the same iteration
+  bool isPrecededByClobber(Loop *L, const Instruction &I) const;
+
+  // Check if an instruction matching Pred can run before the given one
+  // in the same iteration, walking back to the header
+  bool isPrecededBy(Loop *L, const Instruction &I,
+                    function_ref<bool(const Instruction &)> Pred) const;
+
   // Print all hoisted instructions
   void print(const SmallVectorImpl<Instruction *> &Instructions) const;
+
+  // Emit an optimization remark for every hoisted instruction so that
+  // they can be collected with -pass-remarks-output
+  void emitRemarks(Loop *L,
+                   const SmallVectorImpl<Instruction *> &Instructions) const;
 }; // end of class LICMNA
 
 } // end of anonymous namespace
@@ -63,26 +272,427 @@ static RegisterPass<LICMNA> X("LICMNA", "LICMNA Pass",
 LICMNA::LICMNA() : LoopPass(ID) {}
 
 void LICMNA::getAnalysisUsage(AnalysisUsage &AU) const {
-  AU.setPreservesCFG();
+  if (Peel || WidenChecks) {
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.addPreserved<ScalarEvolutionWrapperPass>();
+  }
+  if (Peel || WidenChecks || Devirtualize) {
+    AU.addPreserved<LoopInfoWrapperPass>();
+    AU.addPreserved<DominatorTreeWrapperPass>();
+  } else {
+    AU.setPreservesCFG();
+  }
   AU.addRequiredID(LoopSimplifyID);
+  AU.addRequired<AAResultsWrapperPass>();
+  if (ModRefSummaries) {
+    AU.addRequired<ModRefSummaryNA>();
+  }
   AU.addRequired<LoopInfoWrapperPass>();
   AU.addRequired<DominatorTreeWrapperPass>();
+  AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
 }
 
 bool LICMNA::runOnLoop(Loop *L, LPPassManager &LPM) {
+  // Shows up under the function in -time-trace output, the detail is
+  // only built when tracing
+  TimeTraceScope TimeScope("LICMNA", [&] {
+    return (L->getHeader()->getParent()->getName() + ":" + L->getName())
+        .str();
+  });
+
   SmallVector<Instruction *, 16> Instructions;
-  bool Modified = hoistInstructions(L, Instructions);
+  bool Modified = Peel && peelFirstIteration(L);
+  if (WidenChecks) {
+    Modified |= widenChecks(L, Instructions);
+  }
+  Modified |= hoistInstructions(L, Instructions);
+  if (HoistAllocas) {
+    Modified |= hoistAllocas(L, Instructions);
+  }
+  if (HoistThreadLocals) {
+    Modified |= hoistThreadLocals(L, Instructions);
+  }
+  if (HoistVirtualCalls) {
+    Modified |= hoistVirtualCalls(L, Instructions);
+  }
   print(Instructions);
+  emitRemarks(L, Instructions);
+
+  // Peeling, widened checks and devirtualized calls change what the
+  // function may access, which its callers' summaries depend on
+  if (Modified && ModRefSummaries) {
+    getAnalysis<ModRefSummaryNA>().update(*L->getHeader()->getParent());
+  }
 
   return Modified;
 }
 
+bool LICMNA::peelFirstIteration(Loop *L) {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  // The peeled iteration is a copy of the whole loop
+  unsigned Size = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    Size += BB->size();
+  }
+  if (!L->isInnermost() || Size > PeelBudget || !canPeel(L)) {
+    return false;
+  }
+
+  SmallVector<BranchInst *, 4> Decided;
+  for (BasicBlock *BB : L->blocks()) {
+    auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+    if (BI && BI->isConditional() &&
+        isDecidedAfterFirstIteration(L, BI->getCondition())) {
+      Decided.push_back(BI);
+    }
+  }
+
+  // Peeling only pays off when one of those branches is what keeps an
+  // invariant from being hoisted, i.e. its block is only reached
+  // through one of the edges of the branch
+  auto isGuardedByDecided = [&](const BasicBlock *BB) {
+    return any_of(Decided, [&](BranchInst *BI) {
+      return any_of(successors(BI), [&](BasicBlock *Succ) {
+        return DT->dominates(BasicBlockEdge(BI->getParent(), Succ), BB);
+      });
+    });
+  };
+  bool Guarded = false;
+  for (BasicBlock *BB : L->blocks()) {
+    if (Guarded || !isGuardedByDecided(BB)) {
+      continue;
+    }
+    Guarded = any_of(*BB, [&](const Instruction &I) {
+      return isLoopInvariant(L, I) && !safeToHoist(L, DT, I);
+    });
+  }
+  if (!Guarded) {
+    return false;
+  }
+
+  // The uses after the loop have to get the values of the peeled
+  // iteration when it exits, which the LCSSA phis take care of
+  bool Modified = formLCSSA(*L, *DT, LI, SE);
+  if (!peelLoop(L, 1, LI, SE, *DT, nullptr, true)) {
+    return Modified;
+  }
+  foldPeeledBranches(L);
+
+  return true;
+}
+
+bool LICMNA::isDecidedAfterFirstIteration(Loop *L, Value *Cond) const {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  // A flag that the latch sets to a constant, e.g. "first"
+  auto *PN = dyn_cast<PHINode>(Cond);
+  if (PN && PN->getParent() == L->getHeader()) {
+    BasicBlock *Latch = L->getLoopLatch();
+    return Latch && isa<Constant>(PN->getIncomingValueForBlock(Latch));
+  }
+
+  // A comparison of induction variables that only the first iteration
+  // can fail or satisfy
+  auto *Cmp = dyn_cast<ICmpInst>(Cond);
+  if (!Cmp || !SE->isSCEVable(Cmp->getOperand(0)->getType()) ||
+      getInvariantCondition(L, Cond)) {
+    return false;
+  }
+
+  auto afterFirstIteration = [&](Value *V) {
+    const SCEV *S = SE->getSCEV(V);
+    const auto *AddRec = dyn_cast<SCEVAddRecExpr>(S);
+    return AddRec && AddRec->getLoop() == L ? AddRec->getPostIncExpr(*SE)
+                                            : S;
+  };
+  return SE
+      ->evaluatePredicate(Cmp->getPredicate(),
+                          afterFirstIteration(Cmp->getOperand(0)),
+                          afterFirstIteration(Cmp->getOperand(1)))
+      .hasValue();
+}
+
+Optional<bool> LICMNA::getInvariantCondition(Loop *L, Value *Cond) const {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+
+  Value *Simplified = Cond;
+  if (auto *I = dyn_cast<Instruction>(Cond)) {
+    if (Value *V = SimplifyInstruction(I, {DL})) {
+      Simplified = V;
+    }
+  }
+  if (auto *C = dyn_cast<ConstantInt>(Simplified)) {
+    return C->isOne();
+  }
+
+  auto *Cmp = dyn_cast<ICmpInst>(Cond);
+  if (!Cmp || !SE->isSCEVable(Cmp->getOperand(0)->getType())) {
+    return None;
+  }
+  return SE->evaluatePredicate(Cmp->getPredicate(),
+                               SE->getSCEV(Cmp->getOperand(0)),
+                               SE->getSCEV(Cmp->getOperand(1)));
+}
+
+void LICMNA::foldPeeledBranches(Loop *L) {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  // Flags set by the latch now have the same value on both edges
+  for (auto it = L->getHeader()->begin(); isa<PHINode>(it);) {
+    PHINode &PN = cast<PHINode>(*it);
+    ++it;
+
+    if (Value *V = PN.hasConstantValue()) {
+      PN.replaceAllUsesWith(V);
+      PN.eraseFromParent();
+    }
+  }
+  SE->forgetLoop(L);
+
+  DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+  bool Folded = false;
+  for (BasicBlock *BB : L->blocks()) {
+    auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+    if (!BI || !BI->isConditional()) {
+      continue;
+    }
+
+    Value *Cond = BI->getCondition();
+    if (Optional<bool> Known = getInvariantCondition(L, Cond)) {
+      BI->setCondition(ConstantInt::getBool(BI->getContext(), *Known));
+      RecursivelyDeleteTriviallyDeadInstructions(Cond);
+      Folded |= ConstantFoldTerminator(BB, false, nullptr, &DTU);
+    }
+  }
+  if (!Folded) {
+    return;
+  }
+
+  // Every block of a loop is reachable from its header
+  SmallPtrSet<BasicBlock *, 16> Reachable;
+  SmallVector<BasicBlock *, 16> Worklist = {L->getHeader()};
+  while (!Worklist.empty()) {
+    BasicBlock *BB = Worklist.pop_back_val();
+    if (L->contains(BB) && Reachable.insert(BB).second) {
+      Worklist.append(succ_begin(BB), succ_end(BB));
+    }
+  }
+
+  SmallVector<BasicBlock *, 4> Dead;
+  for (BasicBlock *BB : L->blocks()) {
+    if (!Reachable.count(BB)) {
+      Dead.push_back(BB);
+    }
+  }
+  for (BasicBlock *BB : Dead) {
+    LI->removeBlock(BB);
+  }
+  DeleteDeadBlocks(Dead, &DTU);
+  SE->forgetLoop(L);
+}
+
+bool LICMNA::widenChecks(Loop *L,
+                         SmallVectorImpl<Instruction *> &Instructions) {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  BasicBlock *Latch = L->getLoopLatch();
+  if (!L->isInnermost() || !Latch) {
+    return false;
+  }
+  const SCEV *ExitCount = SE->getExitCount(L, Latch);
+  if (isa<SCEVCouldNotCompute>(ExitCount)) {
+    return false;
+  }
+
+  // Unless a check fails, the loop runs until its latch exits
+  SmallVector<BranchInst *, 4> Checks;
+  for (BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      if (!isGuaranteedToTransferExecutionToSuccessor(&I)) {
+        return false;
+      }
+    }
+    if (BB == Latch) {
+      continue;
+    }
+
+    auto *BI = dyn_cast<BranchInst>(BB->getTerminator());
+    for (BasicBlock *Succ : successors(BB)) {
+      if (L->contains(Succ)) {
+        continue;
+      }
+      if (!BI || !isTrapBlock(L, *Succ)) {
+        return false;
+      }
+      if (DT->dominates(BB, Latch) && isa<ICmpInst>(BI->getCondition())) {
+        Checks.push_back(BI);
+      }
+    }
+  }
+
+  const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+  SCEVExpander Expander(*SE, DL, "widened");
+  DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+  SmallPtrSet<BasicBlock *, 4> Traps;
+  for (BranchInst *BI : Checks) {
+    bool TrueInLoop = L->contains(BI->getSuccessor(0));
+    auto *Cmp = cast<ICmpInst>(BI->getCondition());
+    Value *Cond = getWidenedCondition(L, *Cmp, TrueInLoop, ExitCount,
+                                      Expander, Instructions);
+    if (!Cond) {
+      continue;
+    }
+
+    // The preheader traps the way the check does when it fails, and
+    // the block it splits off becomes the preheader
+    BasicBlock *Trap = BI->getSuccessor(TrueInLoop ? 1 : 0);
+    if (!isa<Constant>(Cond)) {
+      Instruction *Term = L->getLoopPreheader()->getTerminator();
+      Value *Failed = IRBuilder<>(Term).CreateNot(Cond);
+      Instruction *Unreachable =
+          SplitBlockAndInsertIfThen(Failed, Term, true, nullptr, &DTU, LI);
+      Unreachable->getParent()->setName("widened.trap");
+      Term->getParent()->setName("widened.ph");
+      ValueToValueMapTy VMap;
+      for (Instruction &I : Trap->instructionsWithoutDebug()) {
+        if (I.isTerminator()) {
+          continue;
+        }
+        Instruction *Clone = I.clone();
+        Clone->insertBefore(Unreachable);
+        VMap[&I] = Clone;
+        RemapInstruction(Clone, VMap,
+                         RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+      }
+    }
+
+    BI->setCondition(ConstantInt::getBool(BI->getContext(), TrueInLoop));
+    RecursivelyDeleteTriviallyDeadInstructions(Cmp);
+    ConstantFoldTerminator(BI->getParent(), false, nullptr, &DTU);
+    Traps.insert(Trap);
+  }
+  if (Traps.empty()) {
+    return false;
+  }
+
+  for (BasicBlock *Trap : Traps) {
+    if (pred_empty(Trap)) {
+      LI->removeBlock(Trap);
+      DeleteDeadBlock(Trap, &DTU);
+    }
+  }
+  SE->forgetLoop(L);
+
+  return true;
+}
+
+bool LICMNA::isTrapBlock(Loop *L, const BasicBlock &BB) const {
+  if (!isa<UnreachableInst>(BB.getTerminator()) || isa<PHINode>(BB.front())) {
+    return false;
+  }
+
+  bool Stops = false;
+  for (const Instruction &I : BB) {
+    for (const Value *Op : I.operands()) {
+      const auto *OpI = dyn_cast<Instruction>(Op);
+      if (OpI && L->contains(OpI)) {
+        return false;
+      }
+    }
+    if (const auto *CI = dyn_cast<CallInst>(&I)) {
+      Stops |= CI->doesNotReturn();
+    }
+  }
+
+  return Stops;
+}
+
+Value *LICMNA::getWidenedCondition(
+    Loop *L, const ICmpInst &Cmp, bool TrueInLoop, const SCEV *ExitCount,
+    SCEVExpander &Expander, SmallVectorImpl<Instruction *> &Instructions) {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  if (!SE->isSCEVable(Cmp.getOperand(0)->getType())) {
+    return nullptr;
+  }
+  ICmpInst::Predicate Pred =
+      TrueInLoop ? Cmp.getPredicate() : Cmp.getInversePredicate();
+  const SCEV *LHS = SE->getSCEV(Cmp.getOperand(0));
+  const SCEV *RHS = SE->getSCEV(Cmp.getOperand(1));
+  if (!isa<SCEVAddRecExpr>(LHS)) {
+    std::swap(LHS, RHS);
+    Pred = ICmpInst::getSwappedPredicate(Pred);
+  }
+
+  const auto *AddRec = dyn_cast<SCEVAddRecExpr>(LHS);
+  if (!AddRec || AddRec->getLoop() != L || !AddRec->isAffine() ||
+      !SE->isLoopInvariant(RHS, L) || ICmpInst::isEquality(Pred) ||
+      SE->getTypeSizeInBits(ExitCount->getType()) >
+          SE->getTypeSizeInBits(AddRec->getType())) {
+    return nullptr;
+  }
+
+  // An induction variable that does not wrap takes every value between
+  // the ones of the first and the last iteration, which all pass the
+  // check if both of them do
+  SCEV::NoWrapFlags NoWrap =
+      ICmpInst::isSigned(Pred) ? SCEV::FlagNSW : SCEV::FlagNUW;
+  if (!AddRec->getNoWrapFlags(NoWrap)) {
+    return nullptr;
+  }
+  const SCEV *Iterations =
+      SE->getNoopOrZeroExtend(ExitCount, AddRec->getType());
+  const SCEV *Ends[] = {AddRec->getStart(),
+                        AddRec->evaluateAtIteration(Iterations, *SE)};
+
+  Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+  for (const SCEV *End : Ends) {
+    if (!isSafeToExpandAt(End, InsertPt, *SE) ||
+        !isSafeToExpandAt(RHS, InsertPt, *SE) ||
+        SE->isKnownPredicate(ICmpInst::getInversePredicate(Pred), End,
+                             RHS)) {
+      return nullptr;
+    }
+  }
+
+  IRBuilder<> Builder(InsertPt);
+  Value *Cond = nullptr;
+  for (const SCEV *End : Ends) {
+    if (SE->isKnownPredicate(Pred, End, RHS)) {
+      continue;
+    }
+
+    Type *Ty = AddRec->getType();
+    Value *Check = Builder.CreateICmp(
+        Pred, Expander.expandCodeFor(End, Ty, InsertPt),
+        Expander.expandCodeFor(RHS, Ty, InsertPt), "widened.check");
+    Cond = Cond ? Builder.CreateAnd(Cond, Check, "widened.checks") : Check;
+    for (Value *V : {Check, Cond}) {
+      auto *I = dyn_cast<Instruction>(V);
+      if (I && !is_contained(Instructions, I)) {
+        Instructions.push_back(I);
+      }
+    }
+  }
+
+  return Cond ? Cond : Builder.getTrue();
+}
+
 bool LICMNA::hoistInstructions(
     Loop *L, SmallVectorImpl<Instruction *> &Instructions) const {
   DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
   LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
 
   Instruction *Destination = L->getLoopPreheader()->getTerminator();
+  bool Parallel = ParallelAccesses && L->isAnnotatedParallel();
 
   bool Modified = false;
   for (auto node = GraphTraits<DominatorTree *>::nodes_begin(DT);
@@ -98,7 +708,9 @@ bool LICMNA::hoistInstructions(
       Instruction &I = *it;
       ++it;
 
-      if (isLoopInvariant(L, I) && safeToHoist(L, DT, I)) {
+      if ((isLoopInvariant(L, I) && safeToHoist(L, DT, I)) ||
+          canHoistLoad(L, DT, I) ||
+          (Parallel && canHoistParallelLoad(L, DT, I))) {
         Modified = true;
         I.moveBefore(Destination);
         Instructions.push_back(&I);
@@ -109,6 +721,396 @@ bool LICMNA::hoistInstructions(
   return Modified;
 }
 
+bool LICMNA::hoistAllocas(
+    Loop *L, SmallVectorImpl<Instruction *> &Instructions) const {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  SmallVector<IntrinsicInst *, 4> Saves;
+  SmallVector<AllocaInst *, 4> Allocas;
+  for (BasicBlock *BB : L->blocks()) {
+    if (isInSubLoop(L, LI, BB)) {
+      continue;
+    }
+
+    for (Instruction &I : *BB) {
+      if (auto *II = dyn_cast<IntrinsicInst>(&I)) {
+        if (II->getIntrinsicID() == Intrinsic::stacksave) {
+          Saves.push_back(II);
+        }
+      } else if (auto *AI = dyn_cast<AllocaInst>(&I)) {
+        if (isa<ConstantInt>(AI->getArraySize()) &&
+            !AI->isUsedWithInAlloca()) {
+          Allocas.push_back(AI);
+        }
+      }
+    }
+  }
+
+  if (Saves.empty()) {
+    return false;
+  }
+
+  // An alloca that outlives its iteration may be used by the next ones
+  // and cannot share its memory with them
+  Function *F = L->getHeader()->getParent();
+  Instruction *Destination = &*F->getEntryBlock().getFirstInsertionPt();
+  bool Modified = false;
+  for (AllocaInst *AI : Allocas) {
+    bool Released = any_of(Saves, [&](IntrinsicInst *Save) {
+      return DT->dominates(Save, AI) && isReleasedEachIteration(L, *AI, *Save);
+    });
+
+    if (Released) {
+      Modified = true;
+      AI->moveBefore(Destination);
+      Instructions.push_back(AI);
+    }
+  }
+
+  return removeStackSaves(*F, Saves) || Modified;
+}
+
+bool LICMNA::isReleasedEachIteration(Loop *L, const AllocaInst &AI,
+                                     const IntrinsicInst &Save) const {
+  auto isRestore = [&Save](const Instruction &I) {
+    const auto *II = dyn_cast<IntrinsicInst>(&I);
+    return II && II->getIntrinsicID() == Intrinsic::stackrestore &&
+           II->getArgOperand(0) == &Save;
+  };
+
+  const BasicBlock *Parent = AI.getParent();
+  if (std::any_of(std::next(AI.getIterator()), Parent->end(), isRestore)) {
+    return true;
+  }
+
+  // Paths leaving the loop are fine, only the last iteration gets there
+  SmallVector<const BasicBlock *, 8> Worklist(successors(Parent));
+  SmallPtrSet<const BasicBlock *, 8> Visited;
+  while (!Worklist.empty()) {
+    const BasicBlock *BB = Worklist.pop_back_val();
+    if (BB == L->getHeader()) {
+      return false;
+    }
+    if (!L->contains(BB) || !Visited.insert(BB).second ||
+        any_of(*BB, isRestore)) {
+      continue;
+    }
+
+    Worklist.append(succ_begin(BB), succ_end(BB));
+  }
+
+  return true;
+}
+
+bool LICMNA::removeStackSaves(Function &F,
+                              ArrayRef<IntrinsicInst *> Saves) const {
+  for (const BasicBlock &BB : F) {
+    for (const Instruction &I : BB) {
+      const auto *AI = dyn_cast<AllocaInst>(&I);
+      if (AI && !AI->isStaticAlloca()) {
+        return false;
+      }
+    }
+  }
+
+  bool Modified = false;
+  for (IntrinsicInst *Save : Saves) {
+    bool OnlyRestores = all_of(Save->users(), [](const User *U) {
+      const auto *II = dyn_cast<IntrinsicInst>(U);
+      return II && II->getIntrinsicID() == Intrinsic::stackrestore;
+    });
+    if (!OnlyRestores) {
+      continue;
+    }
+
+    while (!Save->use_empty()) {
+      cast<Instruction>(Save->user_back())->eraseFromParent();
+    }
+    Save->eraseFromParent();
+    Modified = true;
+  }
+
+  return Modified;
+}
+
+// Get the thread local variable whose address a value is, if any
+static GlobalVariable *getThreadLocal(Value *V) {
+  auto *GV = dyn_cast<GlobalVariable>(V);
+  return GV && GV->isThreadLocal() ? GV : nullptr;
+}
+
+bool LICMNA::hoistThreadLocals(
+    Loop *L, SmallVectorImpl<Instruction *> &Instructions) const {
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  if (L->getHeader()->getParent()->isPresplitCoroutine()) {
+    return false;
+  }
+
+  Instruction *Destination = L->getLoopPreheader()->getTerminator();
+  DenseMap<Constant *, Instruction *> Addresses;
+  bool Modified = false;
+  for (BasicBlock *BB : L->blocks()) {
+    if (isInSubLoop(L, LI, BB)) {
+      continue;
+    }
+
+    for (Instruction &I : *BB) {
+      // Thread local variables are constants, and their address is
+      // computed again at every use. Their uses in the loop, also the
+      // ones in constant expressions, are made to use an instruction.
+      for (Use &U : I.operands()) {
+        if (GlobalVariable *GV = getThreadLocal(U.get())) {
+          U.set(getThreadLocalAddress(GV, Destination, Addresses,
+                                      Instructions));
+          Modified = true;
+          continue;
+        }
+
+        auto *CE = dyn_cast<ConstantExpr>(U.get());
+        if (!CE || none_of(CE->operands(), [](const Use &Op) {
+              return getThreadLocal(Op.get()) != nullptr;
+            })) {
+          continue;
+        }
+
+        Instruction *&Expr = Addresses[CE];
+        if (!Expr) {
+          Expr = CE->getAsInstruction(Destination);
+          for (Use &Op : Expr->operands()) {
+            if (GlobalVariable *GV = getThreadLocal(Op.get())) {
+              Op.set(
+                  getThreadLocalAddress(GV, Expr, Addresses, Instructions));
+            }
+          }
+          Instructions.push_back(Expr);
+        }
+        U.set(Expr);
+        Modified = true;
+      }
+    }
+  }
+
+  return Modified;
+}
+
+Instruction *LICMNA::getThreadLocalAddress(
+    GlobalVariable *GV, Instruction *Destination,
+    DenseMap<Constant *, Instruction *> &Addresses,
+    SmallVectorImpl<Instruction *> &Instructions) const {
+  Instruction *&Address = Addresses[GV];
+  if (!Address) {
+    // Code generation keeps a no-op cast of a constant where it is,
+    // so the address is computed once and kept in a register. Only
+    // InstCombine folds it back into the uses.
+    Address = new BitCastInst(GV, GV->getType(), GV->getName() + ".addr",
+                              Destination);
+    Instructions.push_back(Address);
+  }
+
+  return Address;
+}
+
+bool LICMNA::hoistVirtualCalls(
+    Loop *L, SmallVectorImpl<Instruction *> &Instructions) {
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  SmallVector<CallInst *, 4> Calls;
+  for (BasicBlock *BB : L->blocks()) {
+    if (isInSubLoop(L, LI, BB)) {
+      continue;
+    }
+
+    for (Instruction &I : *BB) {
+      auto *CI = dyn_cast<CallInst>(&I);
+      if (CI && CI->isIndirectCall()) {
+        Calls.push_back(CI);
+      }
+    }
+  }
+
+  Instruction *Destination = L->getLoopPreheader()->getTerminator();
+  bool Modified = false;
+  for (CallInst *CI : Calls) {
+    Value *Callee = CI->getCalledOperand()->stripPointerCasts();
+    auto *Load = dyn_cast<LoadInst>(Callee);
+    if (Load && L->contains(Load)) {
+      Modified |= hoistLoadChain(L, Load, Destination, Instructions);
+    }
+
+    Function *Target = Devirtualize ? getLikelyTarget(*CI) : nullptr;
+    if (Target && L->isLoopInvariant(CI->getCalledOperand())) {
+      Modified |= devirtualize(L, CI, Target, Instructions);
+    }
+  }
+
+  return Modified;
+}
+
+bool LICMNA::hoistLoadChain(
+    Loop *L, LoadInst *Load, Instruction *Destination,
+    SmallVectorImpl<Instruction *> &Instructions) const {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+
+  // The address from the inside out, ending with the load
+  SmallVector<Instruction *, 4> Chain = {Load};
+  Value *Address = Load->getPointerOperand();
+  while (auto *I = dyn_cast<Instruction>(Address)) {
+    if (!L->contains(I)) {
+      break;
+    }
+
+    Chain.push_back(I);
+    if (auto *Inner = dyn_cast<LoadInst>(I)) {
+      Address = Inner->getPointerOperand();
+    } else if (isa<GetElementPtrInst>(I) || I->isCast()) {
+      Address = I->getOperand(0);
+    } else {
+      return false;
+    }
+  }
+
+  for (Instruction *I : reverse(Chain)) {
+    auto *ChainLoad = dyn_cast<LoadInst>(I);
+    // A vtable or function pointer load may trap on a null object, so
+    // unless it cannot it has to run whenever the loop is entered
+    bool Hoistable =
+        ChainLoad ? ChainLoad->isSimple() && checkInstructionOperands(L, *I) &&
+                        isUnmodified(L, *ChainLoad) &&
+                        (isSafeToSpeculativelyExecute(I) ||
+                         isGuaranteedToExecute(L, DT, *I))
+                  : isLoopInvariant(L, *I) && safeToHoist(L, DT, *I);
+    if (!Hoistable) {
+      return I != Chain.back();
+    }
+
+    I->moveBefore(Destination);
+    Instructions.push_back(I);
+  }
+
+  return true;
+}
+
+bool LICMNA::isUnmodified(Loop *L, const LoadInst &Load) const {
+  if (Load.hasMetadata(LLVMContext::MD_invariant_load) ||
+      Load.hasMetadata(LLVMContext::MD_invariant_group)) {
+    return true;
+  }
+
+  // Vtables do not change, which the frontend only states on the
+  // vtable pointer loads
+  const auto *VTable = dyn_cast<LoadInst>(
+      Load.getPointerOperand()->stripInBoundsConstantOffsets());
+  if (VTable && VTable->hasMetadata(LLVMContext::MD_invariant_group)) {
+    return true;
+  }
+
+  MemoryLocation Location = MemoryLocation::get(&Load);
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (mayWriteToMemory(I) && isModSet(getModRefInfo(I, Location))) {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+bool LICMNA::canHoistLoad(Loop *L, DominatorTree *DT,
+                          const Instruction &I) const {
+  // A load that may trap has to run in the first iteration already
+  const auto *Load = dyn_cast<LoadInst>(&I);
+  return ModRefSummaries && Load && Load->isSimple() &&
+         checkInstructionOperands(L, I) && isUnmodified(L, *Load) &&
+         (isSafeToSpeculativelyExecute(&I) ||
+          isGuaranteedToExecute(L, DT, I));
+}
+
+ModRefInfo LICMNA::getModRefInfo(const Instruction &I,
+                                 const MemoryLocation &Location) const {
+  AAResults *AA = &getAnalysis<AAResultsWrapperPass>().getAAResults();
+
+  const auto *Call = dyn_cast<CallBase>(&I);
+  if (ModRefSummaries && Call) {
+    return getAnalysis<ModRefSummaryNA>().getModRefInfo(*Call, Location, *AA);
+  }
+  return AA->getModRefInfo(&I, Location);
+}
+
+bool LICMNA::mayWriteToMemory(const Instruction &I) const {
+  const auto *Call = dyn_cast<CallBase>(&I);
+  if (ModRefSummaries && Call && I.mayWriteToMemory()) {
+    const ModRefSummary *Summary =
+        getAnalysis<ModRefSummaryNA>().getSummary(*Call);
+    return !Summary || !Summary->writesNothing();
+  }
+  return I.mayWriteToMemory();
+}
+
+Function *LICMNA::getLikelyTarget(CallInst &CI) const {
+  if (MDNode *Callees = CI.getMetadata(LLVMContext::MD_callees)) {
+    if (Callees->getNumOperands() == 1) {
+      return mdconst::dyn_extract_or_null<Function>(Callees->getOperand(0));
+    }
+    return nullptr;
+  }
+
+  // The most frequent target of the value profile, if it is called
+  // most of the time
+  InstrProfValueData Data[1];
+  uint32_t NumData;
+  uint64_t Total;
+  if (!getValueProfDataFromInst(CI, IPVK_IndirectCallTarget, 1, Data,
+                                NumData, Total) ||
+      Data[0].Count * 2 <= Total) {
+    return nullptr;
+  }
+
+  for (Function &F : *CI.getModule()) {
+    if (F.getGUID() == Data[0].Value) {
+      return &F;
+    }
+  }
+
+  return nullptr;
+}
+
+bool LICMNA::devirtualize(Loop *L, CallInst *CI, Function *Target,
+                          SmallVectorImpl<Instruction *> &Instructions) {
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+  LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+
+  if (!isLegalToPromote(*CI, Target)) {
+    return false;
+  }
+
+  CallBase &Direct = promoteCallWithIfThenElse(*CI, Target);
+  BasicBlock *Then = Direct.getParent();
+  BasicBlock *Else = CI->getParent();
+  BasicBlock *Merge = Then->getSingleSuccessor();
+  for (BasicBlock *BB : {Then, Else, Merge}) {
+    if (!LI->getLoopFor(BB)) {
+      L->addBasicBlockToLoop(BB, *LI);
+    }
+  }
+  DT->recalculate(*L->getHeader()->getParent());
+  if (auto *SE = getAnalysisIfAvailable<ScalarEvolutionWrapperPass>()) {
+    SE->getSE().forgetLoop(L);
+  }
+
+  // The branch on the comparison is the same in every iteration, which
+  // makes it cheap to predict and lets unswitching split the loop on it
+  BasicBlock *Check = Then->getSinglePredecessor();
+  auto *Branch = cast<BranchInst>(Check->getTerminator());
+  auto *Cmp = cast<Instruction>(Branch->getCondition());
+  Cmp->moveBefore(L->getLoopPreheader()->getTerminator());
+  Instructions.push_back(Cmp);
+
+  return true;
+}
+
 bool LICMNA::isInSubLoop(Loop *L, LoopInfo *LI, BasicBlock *BB) const {
   Loop *ParentLoop = LI->getLoopFor(BB);
 
@@ -142,16 +1144,97 @@ bool LICMNA::safeToHoist(Loop *L, DominatorTree *DT,
 
 bool LICMNA::dominatesExits(Loop *L, DominatorTree *DT,
                              const Instruction &I) const {
+  // A loop without exits may run forever without reaching it
   SmallVector<BasicBlock *, 16> Exits;
   L->getUniqueExitBlocks(Exits);
   const BasicBlock *Parent = I.getParent();
+  if (Exits.empty() || any_of(Exits, [&](const BasicBlock *BB) {
+        return !DT->dominates(Parent, BB);
+      })) {
+    return false;
+  }
+
+  auto mayNotReturn = [](const Instruction &Prev) {
+    return !isGuaranteedToTransferExecutionToSuccessor(&Prev);
+  };
+
+  // Iterations that do not go through the block can run before it, so
+  // then any instruction of the loop can keep it from being reached
+  const BasicBlock *Latch = L->getLoopLatch();
+  if (!Latch || !DT->dominates(Parent, Latch)) {
+    return none_of(L->blocks(), [&](const BasicBlock *BB) {
+      return any_of(*BB, mayNotReturn);
+    });
+  }
+
+  return !isPrecededBy(L, I, mayNotReturn);
+}
+
+bool LICMNA::canHoistParallelLoad(Loop *L, DominatorTree *DT,
+                                  const Instruction &I) const {
+  const auto *LI = dyn_cast<LoadInst>(&I);
+  if (!LI || !LI->isSimple() || !checkInstructionOperands(L, I) ||
+      isPrecededByClobber(L, I)) {
+    return false;
+  }
+
+  // Otherwise the load has to run in the first iteration already
+  return isSafeToSpeculativelyExecute(&I) || isGuaranteedToExecute(L, DT, I);
+}
 
-  bool Dominates = false;
-  for (BasicBlock *BB : Exits) {
-    Dominates &= DT->dominates(Parent, BB);
+bool LICMNA::isGuaranteedToExecute(Loop *L, DominatorTree *DT,
+                                   const Instruction &I) const {
+  SmallVector<BasicBlock *, 8> Exiting;
+  L->getExitingBlocks(Exiting);
+  Exiting.push_back(L->getLoopLatch());
+  if (!all_of(Exiting, [&](const BasicBlock *BB) {
+        return BB && DT->dominates(I.getParent(), BB);
+      })) {
+    return false;
   }
 
-  return Dominates;
+  return !isPrecededBy(L, I, [](const Instruction &Prev) {
+    return !isGuaranteedToTransferExecutionToSuccessor(&Prev);
+  });
+}
+
+bool LICMNA::isPrecededByClobber(Loop *L, const Instruction &I) const {
+  return isPrecededBy(L, I, [&](const Instruction &Prev) {
+    return mayWriteToMemory(Prev) ||
+           !isGuaranteedToTransferExecutionToSuccessor(&Prev);
+  });
+}
+
+bool LICMNA::isPrecededBy(
+    Loop *L, const Instruction &I,
+    function_ref<bool(const Instruction &)> Pred) const {
+  const BasicBlock *Parent = I.getParent();
+  if (std::any_of(Parent->begin(), I.getIterator(), Pred)) {
+    return true;
+  }
+
+  // Walk back to the header, the back edges start the previous
+  // iteration
+  SmallVector<const BasicBlock *, 8> Worklist;
+  SmallPtrSet<const BasicBlock *, 8> Visited;
+  if (Parent != L->getHeader()) {
+    Worklist.append(pred_begin(Parent), pred_end(Parent));
+  }
+  while (!Worklist.empty()) {
+    const BasicBlock *BB = Worklist.pop_back_val();
+    if (!Visited.insert(BB).second) {
+      continue;
+    }
+    if (any_of(*BB, Pred)) {
+      return true;
+    }
+
+    if (BB != L->getHeader()) {
+      Worklist.append(pred_begin(BB), pred_end(BB));
+    }
+  }
+
+  return false;
 }
 
 void LICMNA::print(const SmallVectorImpl<Instruction *> &Instructions) const {
@@ -159,4 +1242,23 @@ void LICMNA::print(const SmallVectorImpl<Instruction *> &Instructions) const {
     I->print(errs());
     errs() << '\n';
   }
+}
+
+void LICMNA::emitRemarks(
+    Loop *L, const SmallVectorImpl<Instruction *> &Instructions) const {
+  OptimizationRemarkEmitter *ORE =
+      &getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+
+  for (Instruction *I : Instructions) {
+    ORE->emit([&]() {
+      std::string Text;
+      raw_string_ostream OS(Text);
+      I->print(OS);
+
+      return OptimizationRemark("LICMNA", "Hoisted", I)
+             << "hoisted loop invariant out of loop with header "
+             << ore::NV("Header", L->getHeader()->getName()) << ": "
+             << ore::NV("Inst", StringRef(OS.str()).trim());
+    });
+  }
 }
\ No newline at end of file
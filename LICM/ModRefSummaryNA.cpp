@@ -0,0 +1,298 @@
+#include "ModRefSummaryNA.h"
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+bool ModRefSummary::writesNothing() const {
+  return !isModSet(Other) &&
+         none_of(Globals,
+                 [](const auto &Entry) { return isModSet(Entry.second); }) &&
+         none_of(Arguments, [](ModRefInfo MR) { return isModSet(MR); });
+}
+
+char ModRefSummaryNA::ID = 0;
+
+static RegisterPass<ModRefSummaryNA> X("ModRefSummaryNA",
+                                        "ModRefSummaryNA Pass",
+                                        false /* Only looks at CFG */,
+                                        true /* Analysis Pass */);
+
+ModRefSummaryNA::ModRefSummaryNA() : ImmutablePass(ID) {}
+
+bool ModRefSummaryNA::doInitialization(Module &Mod) {
+  M = &Mod;
+  return false;
+}
+
+void ModRefSummaryNA::summariseModule() {
+  TimeTraceScope TimeScope("ModRefSummaryNA");
+  Summarised = true;
+  CallGraph CG(*M);
+
+  for (const Function &F : *M) {
+    if (F.isDeclaration() || F.isInterposable()) {
+      Summaries[&F] = summarise(F);
+    }
+  }
+
+  // Callees come before their callers, the functions of a recursive
+  // SCC start from nothing and are summarised until none changes
+  for (auto SCC = scc_begin(&CG); !SCC.isAtEnd(); ++SCC) {
+    SmallVector<const Function *, 4> Functions;
+    for (const CallGraphNode *Node : *SCC) {
+      const Function *F = Node->getFunction();
+      if (F && !F->isDeclaration() && !F->isInterposable()) {
+        Summaries[F].Arguments.assign(F->arg_size(), ModRefInfo::NoModRef);
+        Functions.push_back(F);
+      }
+    }
+
+    if (Functions.empty()) {
+      continue;
+    }
+
+    // One event for all the iterations, which go over the functions of
+    // the SCC together
+    TimeTraceScope SCCScope("ModRefSummaryNA function", [&] {
+      std::string Names;
+      for (const Function *F : Functions) {
+        Names += (Names.empty() ? "" : ",") + F->getName().str();
+      }
+      return Names;
+    });
+
+    bool Changed = true;
+    while (Changed) {
+      Changed = false;
+      for (const Function *F : Functions) {
+        ModRefSummary Summary = summarise(*F);
+        if (!(Summary == Summaries[F])) {
+          Summaries[F] = std::move(Summary);
+          Changed = SCC.hasCycle();
+        }
+      }
+    }
+  }
+}
+
+static StringRef getName(ModRefInfo MR) {
+  switch (clearMust(MR)) {
+  case ModRefInfo::Ref:
+    return "ref";
+  case ModRefInfo::Mod:
+    return "mod";
+  case ModRefInfo::ModRef:
+    return "modref";
+  default:
+    return "none";
+  }
+}
+
+void ModRefSummaryNA::print(raw_ostream &OS, const Module *) const {
+  if (!Summarised) {
+    const_cast<ModRefSummaryNA *>(this)->summariseModule();
+  }
+
+  for (const Function &F : *M) {
+    auto It = Summaries.find(&F);
+    if (F.isDeclaration() || It == Summaries.end()) {
+      continue;
+    }
+
+    const ModRefSummary &Summary = It->second;
+    OS << F.getName() << ": other=" << getName(Summary.Other);
+    for (const auto &Entry : Summary.Globals) {
+      OS << ", @" << Entry.first->getName() << '=' << getName(Entry.second);
+    }
+    for (unsigned i = 0; i < Summary.Arguments.size(); ++i) {
+      if (!isNoModRef(Summary.Arguments[i])) {
+        OS << ", arg" << i << '=' << getName(Summary.Arguments[i]);
+      }
+    }
+    OS << '\n';
+  }
+}
+
+const ModRefSummary *ModRefSummaryNA::getSummary(const CallBase &Call) {
+  if (!Summarised) {
+    summariseModule();
+  }
+  return lookup(Call.getCalledFunction());
+}
+
+void ModRefSummaryNA::update(const Function &F) {
+  if (!Summarised) {
+    return;
+  }
+
+  // The callers are summarised again until none changes, those of a
+  // recursive SCC only grow from their current summaries
+  SmallVector<const Function *, 8> Worklist = {&F};
+  while (!Worklist.empty()) {
+    const Function *Changed = Worklist.pop_back_val();
+    ModRefSummary Summary = summarise(*Changed);
+    ModRefSummary &Entry = Summaries[Changed];
+    if (Summary == Entry) {
+      continue;
+    }
+
+    Entry = std::move(Summary);
+    for (const User *U : Changed->users()) {
+      const auto *Call = dyn_cast<CallBase>(U);
+      const Function *Caller = Call ? Call->getFunction() : nullptr;
+      if (Call && Call->getCalledFunction() == Changed && Caller &&
+          lookup(Caller) && !Caller->isInterposable()) {
+        Worklist.push_back(Caller);
+      }
+    }
+  }
+}
+
+const ModRefSummary *ModRefSummaryNA::lookup(const Function *F) const {
+  auto It = Summaries.find(F);
+  return It == Summaries.end() ? nullptr : &It->second;
+}
+
+ModRefInfo ModRefSummaryNA::getModRefInfo(const CallBase &Call,
+                                          const MemoryLocation &Location,
+                                          AAResults &AA) {
+  ModRefInfo MR = clearMust(AA.getModRefInfo(&Call, Location));
+  const ModRefSummary *Summary = getSummary(Call);
+  if (!Summary || isNoModRef(MR)) {
+    return MR;
+  }
+
+  ModRefInfo Known = Summary->Other;
+  for (const auto &Entry : Summary->Globals) {
+    if (AA.alias(MemoryLocation::getBeforeOrAfter(Entry.first), Location) !=
+        AliasResult::NoAlias) {
+      Known = unionModRef(Known, Entry.second);
+    }
+  }
+  for (unsigned i = 0; i < Summary->Arguments.size(); ++i) {
+    if (!isNoModRef(Summary->Arguments[i]) &&
+        AA.alias(MemoryLocation::getBeforeOrAfter(Call.getArgOperand(i)),
+                 Location) != AliasResult::NoAlias) {
+      Known = unionModRef(Known, Summary->Arguments[i]);
+    }
+  }
+
+  return intersectModRef(MR, Known);
+}
+
+ModRefSummary ModRefSummaryNA::summarise(const Function &F) const {
+  ModRefSummary Summary;
+  Summary.Arguments.assign(F.arg_size(), ModRefInfo::NoModRef);
+
+  // The body of a function the linker may replace need not be the one
+  // that runs, its attributes hold for all of them
+  if (F.isDeclaration() || F.isInterposable()) {
+    if (F.doesNotAccessMemory() || F.onlyAccessesInaccessibleMemory()) {
+      return Summary;
+    }
+
+    ModRefInfo MR = ModRefInfo::ModRef;
+    if (F.onlyReadsMemory()) {
+      MR = ModRefInfo::Ref;
+    } else if (F.hasFnAttribute(Attribute::WriteOnly)) {
+      MR = ModRefInfo::Mod;
+    }
+    if (!F.onlyAccessesArgMemory()) {
+      Summary.Other = MR;
+      return Summary;
+    }
+
+    for (const Argument &A : F.args()) {
+      if (!A.getType()->isPointerTy() || A.hasAttribute(Attribute::ReadNone)) {
+        continue;
+      }
+      if (A.onlyReadsMemory()) {
+        Summary.Arguments[A.getArgNo()] = intersectModRef(MR, ModRefInfo::Ref);
+      } else if (A.hasAttribute(Attribute::WriteOnly)) {
+        Summary.Arguments[A.getArgNo()] = intersectModRef(MR, ModRefInfo::Mod);
+      } else {
+        Summary.Arguments[A.getArgNo()] = MR;
+      }
+    }
+    return Summary;
+  }
+
+  for (const Instruction &I : instructions(F)) {
+    if (!I.mayReadOrWriteMemory()) {
+      continue;
+    }
+    if (const auto *Call = dyn_cast<CallBase>(&I)) {
+      addCall(Summary, *Call);
+      continue;
+    }
+
+    // Atomics may order the accesses of other threads as well
+    Optional<MemoryLocation> Location = MemoryLocation::getOrNone(&I);
+    if (I.isAtomic() || !Location) {
+      Summary.Other = ModRefInfo::ModRef;
+      continue;
+    }
+
+    ModRefInfo MR = I.mayWriteToMemory() ? ModRefInfo::Mod : ModRefInfo::Ref;
+    if (I.mayWriteToMemory() && I.mayReadFromMemory()) {
+      MR = ModRefInfo::ModRef;
+    }
+    addAccess(Summary, Location->Ptr, MR);
+  }
+
+  return Summary;
+}
+
+void ModRefSummaryNA::addAccess(ModRefSummary &Summary, const Value *Ptr,
+                                ModRefInfo MR) const {
+  const Value *Object = getUnderlyingObject(Ptr);
+
+  // The stack of the function and the copies of byval arguments are
+  // gone once it returns
+  const auto *A = dyn_cast<Argument>(Object);
+  if (isa<AllocaInst>(Object) || (A && A->hasByValAttr())) {
+    return;
+  }
+
+  if (A) {
+    ModRefInfo &Entry = Summary.Arguments[A->getArgNo()];
+    Entry = unionModRef(Entry, MR);
+  } else if (const auto *GV = dyn_cast<GlobalValue>(Object)) {
+    ModRefInfo &Entry =
+        Summary.Globals.try_emplace(GV, ModRefInfo::NoModRef).first->second;
+    Entry = unionModRef(Entry, MR);
+  } else {
+    Summary.Other = unionModRef(Summary.Other, MR);
+  }
+}
+
+void ModRefSummaryNA::addCall(ModRefSummary &Summary,
+                              const CallBase &Call) const {
+  const ModRefSummary *Callee = lookup(Call.getCalledFunction());
+  if (!Callee) {
+    Summary.Other = unionModRef(Summary.Other, Call.onlyReadsMemory()
+                                                   ? ModRefInfo::Ref
+                                                   : ModRefInfo::ModRef);
+    return;
+  }
+
+  Summary.Other = unionModRef(Summary.Other, Callee->Other);
+  for (const auto &Entry : Callee->Globals) {
+    addAccess(Summary, Entry.first, Entry.second);
+  }
+  for (unsigned i = 0; i < Callee->Arguments.size(); ++i) {
+    if (i < Call.arg_size() && !isNoModRef(Callee->Arguments[i])) {
+      addAccess(Summary, Call.getArgOperand(i), Callee->Arguments[i]);
+    }
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef MODREFSUMMARYNA_H
+#define MODREFSUMMARYNA_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/IR/ValueMap.h"
+#include "llvm/Pass.h"
+
+namespace llvm {
+class CallBase;
+class Function;
+class GlobalValue;
+class Module;
+class raw_ostream;
+} // end of namespace llvm
+
+// The memory a function may read or write, including in the functions
+// it calls, apart from its own stack
+struct ModRefSummary {
+  // Globals the function accesses by name
+  llvm::DenseMap<const llvm::GlobalValue *, llvm::ModRefInfo> Globals;
+  // Memory the pointer arguments point into, by argument number
+  llvm::SmallVector<llvm::ModRefInfo, 4> Arguments;
+  // Any other memory, e.g. reached through a loaded pointer, which may
+  // be any of the above as well
+  llvm::ModRefInfo Other = llvm::ModRefInfo::NoModRef;
+
+  // Check if the function writes no memory its callers can see
+  bool writesNothing() const;
+
+  bool operator==(const ModRefSummary &RHS) const {
+    return Globals == RHS.Globals && Arguments == RHS.Arguments &&
+           Other == RHS.Other;
+  }
+};
+
+// Computes the summary of every function of the module bottom-up over
+// the call graph, so that loop passes can see through the calls that do
+// not touch the memory they are interested in. Loop passes cannot
+// require module passes, so this is an immutable pass computing the
+// summaries once, on the first query. Passes that change a function
+// afterwards have to call update() for it. Functions the linker may
+// replace are summarised from their attributes only.
+class ModRefSummaryNA : public llvm::ImmutablePass {
+public:
+  static char ID;
+
+  ModRefSummaryNA();
+  bool doInitialization(llvm::Module &M) override;
+  void print(llvm::raw_ostream &OS, const llvm::Module *M) const override;
+
+  // Get the summary of the function a call calls, or null if it is an
+  // indirect call or the function has not been summarised
+  const ModRefSummary *getSummary(const llvm::CallBase &Call);
+
+  // Get how a call may access a location, using the summary of the
+  // callee along with alias analysis to map it to the call site
+  llvm::ModRefInfo getModRefInfo(const llvm::CallBase &Call,
+                                 const llvm::MemoryLocation &Location,
+                                 llvm::AAResults &AA);
+
+  // Summarise a function again after it was changed, along with the
+  // functions calling it whose summaries change with it
+  void update(const llvm::Function &F);
+
+private:
+  // Summarise every function of the module
+  void summariseModule();
+
+  // Get the summary of a function computed so far, or null if there is
+  // none
+  const ModRefSummary *lookup(const llvm::Function *F) const;
+
+  // Summarise a function from its instructions, using the summaries of
+  // its callees, or from its attributes if it is only declared or may
+  // be replaced at link time
+  ModRefSummary summarise(const llvm::Function &F) const;
+
+  // Add how a pointer is accessed to a summary, depending on what it
+  // points into
+  void addAccess(ModRefSummary &Summary, const llvm::Value *Ptr,
+                 llvm::ModRefInfo MR) const;
+
+  // Add the accesses of a call to the summary of its caller
+  void addCall(ModRefSummary &Summary, const llvm::CallBase &Call) const;
+
+  // Drops the summary of a deleted function, and leaves it with the
+  // function when its uses are replaced with another one
+  struct SummaryMapConfig : llvm::ValueMapConfig<const llvm::Function *> {
+    enum { FollowRAUW = false };
+  };
+
+  llvm::Module *M = nullptr;
+  bool Summarised = false;
+  llvm::ValueMap<const llvm::Function *, ModRefSummary, SummaryMapConfig>
+      Summaries;
+};
+
+#endif // MODREFSUMMARYNA_H
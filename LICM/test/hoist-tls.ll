@@ -0,0 +1,30 @@
+; The address of a thread local variable is computed once per loop: the
+; __tls_get_addr call of the general dynamic model stays in the
+; preheader after code generation.
+; RUN: opt -enable-new-pm=0 -load %shlibdir/LICM_NA%shlibext -LICMNA \
+; RUN:     -licmna-hoist-tls %s 2>/dev/null \
+; RUN:   | llc -O2 -relocation-model=pic | FileCheck %s
+
+; CHECK-LABEL: f:
+; CHECK: callq __tls_get_addr@PLT
+; CHECK: .LBB0_1:
+; CHECK-NOT: __tls_get_addr
+; CHECK: jl .LBB0_1
+
+target triple = "x86_64-unknown-linux-gnu"
+
+@counter = thread_local global i64 0
+
+define void @f(i64* %out, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %v = load volatile i64, i64* @counter
+  store volatile i64 %v, i64* %out
+  %inc = add i32 %i, 1
+  %c = icmp slt i32 %inc, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret void
+}
@@ -1,26 +1,401 @@
+#include <cmath>
+#include <map>
+#include <memory>
+#include <set>
 #include <string>
+#include <type_traits>
+#include <vector>
 
+#include "LoopInfoNA.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/LoopAnalysisManager.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/CodeGen/StableHashing.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Remarks/Remark.h"
+#include "llvm/Remarks/RemarkParser.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/TimeProfiler.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 
 using namespace llvm;
 
+static cl::opt<bool>
+    Dedup("loopinfona-dedup", cl::init(false),
+          cl::desc("Analyse structurally identical loops only once and "
+                   "report duplicate counts"));
+
+static cl::opt<bool>
+    Summary("loopinfona-summary", cl::init(false),
+            cl::desc("Print quantiles of every metric per loop depth "
+                     "instead of one line per loop"));
+
+static cl::opt<std::string>
+    SummaryOut("loopinfona-summary-out", cl::value_desc("filename"),
+               cl::desc("Write the summary histograms to a file so they "
+                        "can be merged later"));
+
+static cl::list<std::string>
+    SummaryIn("loopinfona-summary-in", cl::value_desc("filename"),
+              cl::CommaSeparated,
+              cl::desc("Merge summary histograms written by earlier "
+                       "runs into this one"));
+
+static cl::opt<double>
+    SampleFraction("loopinfona-sample", cl::init(1.0),
+                   cl::value_desc("fraction"),
+                   cl::desc("Only analyse this fraction of the functions "
+                            "and extrapolate the totals"));
+
+static cl::opt<unsigned>
+    SampleSeed("loopinfona-sample-seed", cl::init(0),
+               cl::desc("Seed selecting the sampled functions"));
+
+static cl::opt<bool> SampleStratify(
+    "loopinfona-sample-stratify", cl::init(false),
+    cl::desc("Extrapolate separately per function size class"));
+
+static cl::opt<std::string> Profile(
+    "loopinfona-profile", cl::value_desc("filename"),
+    cl::desc("Report the samples of a perf script dump or a text sample "
+             "profile that fall into every loop"));
+
+static cl::opt<std::string>
+    HTML("loopinfona-html", cl::value_desc("filename"),
+         cl::desc("Write a static HTML report of the analysed loops"));
+
+static cl::opt<std::string> HTMLRemarks(
+    "loopinfona-html-remarks", cl::value_desc("filename"),
+    cl::desc("Add the LICMNA hoists of a YAML remarks file, written with "
+             "-pass-remarks-output, to the HTML report"));
+
+static cl::opt<std::string> Filter(
+    "loopinfona-filter", cl::value_desc("expression"),
+    cl::desc("Only report loops matching an expression such as "
+             "'depth>=2 && atomics>0 && func=~\"^hot_\"'"));
+
+static cl::opt<bool> UnrollHints(
+    "loopinfona-unroll-hints", cl::init(false),
+    cl::desc("Write the unroll count recommended for every innermost "
+             "loop as llvm.loop.unroll.count metadata"));
+
+static cl::opt<unsigned> UnrollBudget(
+    "loopinfona-unroll-budget", cl::init(64),
+    cl::desc("Largest number of instructions of an unrolled loop body, "
+             "twice that for loops with recurrences"));
+
+static cl::opt<unsigned> UnrollRegisters(
+    "loopinfona-unroll-registers", cl::init(16),
+    cl::desc("Number of registers the unrolled copies of a loop body "
+             "may keep live at once"));
+
+static cl::opt<unsigned> IssueWidth(
+    "loopinfona-issue-width", cl::init(4),
+    cl::desc("Number of instructions issued per cycle, loops whose "
+             "reductions take longer than issuing their body are "
+             "latency bound"));
+
+static cl::list<std::string> SyncCalls(
+    "loopinfona-sync-calls", cl::value_desc("symbol"), cl::CommaSeparated,
+    cl::desc("Functions counted as synchronization calls on top of the "
+             "pthread locks and waits, sem_wait, syscall and the sleeps"));
+
+static cl::list<std::string> IOCalls(
+    "loopinfona-io-calls", cl::value_desc("symbol"), cl::CommaSeparated,
+    cl::desc("Functions counted as I/O calls on top of the library "
+             "functions known to do I/O"));
+
 namespace {
-class LoopInfoNA : public LoopPass {
+// Metrics of a loop record that are summarized and extrapolated, named
+// as in the output
+static const struct {
+  const char *Name;
+  uint64_t (*Get)(const LoopRecord &Record);
+} SummaryMetrics[] = {
+    {"BBs", [](const LoopRecord &R) -> uint64_t { return R.Blocks; }},
+    {"instrs", [](const LoopRecord &R) -> uint64_t { return R.Instructions; }},
+    {"atomics", [](const LoopRecord &R) -> uint64_t { return R.Atomics; }},
+    {"branches", [](const LoopRecord &R) -> uint64_t { return R.Branches; }},
+    {"exiting",
+     [](const LoopRecord &R) -> uint64_t { return R.ExitingBlocks; }},
+    {"exits", [](const LoopRecord &R) -> uint64_t { return R.ExitBlocks; }},
+    {"recMII", [](const LoopRecord &R) -> uint64_t { return R.RecMII; }},
+    {"loads", [](const LoopRecord &R) -> uint64_t { return R.Loads; }},
+    {"independentLoads",
+     [](const LoopRecord &R) -> uint64_t { return R.IndependentLoads; }},
+    {"loadChain", [](const LoopRecord &R) -> uint64_t { return R.LoadChain; }},
+    {"vectorInstrs",
+     [](const LoopRecord &R) -> uint64_t { return R.VectorInstructions; }},
+    {"scalarInstrs",
+     [](const LoopRecord &R) -> uint64_t { return R.ScalarInstructions; }},
+    {"maskedOps", [](const LoopRecord &R) -> uint64_t { return R.MaskedOps; }},
+    {"gatherScatter",
+     [](const LoopRecord &R) -> uint64_t { return R.GatherScatter; }},
+    {"syncCalls", [](const LoopRecord &R) -> uint64_t { return R.SyncCalls; }},
+    {"ioCalls", [](const LoopRecord &R) -> uint64_t { return R.IOCalls; }},
+    {"samples", [](const LoopRecord &R) -> uint64_t { return R.Samples; }},
+};
+
+// Sampling statistics of the functions in one size class
+struct SampleStratum {
+  uint64_t Functions = 0;
+  uint64_t Sampled = 0;
+  // Per metric sums over the sampled functions of the function totals
+  // and of their squares, the last metric is the number of loops
+  double Sum[array_lengthof(SummaryMetrics) + 1] = {};
+  double SumSquares[array_lengthof(SummaryMetrics) + 1] = {};
+};
+
+// Records are allocated in a BumpPtrAllocator and never destroyed
+static_assert(std::is_trivially_destructible<LoopRecord>::value,
+              "LoopRecord must not own memory");
+
+// A fingerprint seen before along with the loop it was computed for
+struct FingerprintEntry {
+  LoopRecord Record;
+  int FirstID;
+  int Count;
+  // Interned copy of the function name, the module may already be gone
+  // when the duplicates are reported
+  StringRef FirstFunction;
+};
+
+// Mergeable streaming histogram of non negative values. Values below
+// 32 get their own bucket, larger ones are put in one of 16 buckets
+// per power of two, which bounds the relative error of a quantile to
+// about 6% while only keeping the non empty buckets.
+class Histogram {
 public:
-  static char ID;
+  void add(uint64_t Value, uint64_t Times = 1);
+  void merge(const Histogram &Other);
 
-  LoopInfoNA();
-  bool runOnLoop(Loop *L, LPPassManager &LPM) override;
+  // Get an estimate of the value below which a fraction Q of the
+  // values fall
+  uint64_t quantile(double Q) const;
+
+  uint64_t count() const { return Count; }
+  uint64_t sum() const { return Sum; }
+  uint64_t min() const { return Min; }
+  uint64_t max() const { return Max; }
+
+  // Read and write the histogram as space separated fields
+  void write(raw_ostream &OS) const;
+  bool read(StringRef Fields);
 
 private:
-  // Global loop counter used as an ID
-  int numLoops;
+  static unsigned getBucket(uint64_t Value);
+  static uint64_t getLowerBound(unsigned Bucket);
+  static uint64_t getUpperBound(unsigned Bucket);
+
+  std::map<unsigned, uint64_t> Buckets;
+  uint64_t Count = 0;
+  uint64_t Sum = 0;
+  uint64_t Min = UINT64_MAX;
+  uint64_t Max = 0;
+};
+
+// Samples read from a profile, attributed to loops through the debug
+// locations of their instructions. Two formats are understood:
+//  - perf script output with source lines (perf script -F ip,srcline),
+//    where every file:line token is one sample on that line
+//  - the text sample profile format used by llvm-profdata, where
+//    samples are given per line offset from the start of a function
+class LoopProfile {
+public:
+  bool load(StringRef Filename, std::string &Error);
+
+  // Get the samples on the source lines of the loop
+  uint64_t getSamples(Loop *L) const;
+
+  // Get the number of samples in the whole profile
+  uint64_t getTotal() const { return Total; }
+
+private:
+  bool loadPerfScript(const MemoryBuffer &Buffer, std::string &Error);
+  bool loadSampleProfile(const MemoryBuffer &Buffer, std::string &Error);
+
+  bool IsSampleProfile = false;
+
+  // Samples per source file name, without directories, and line
+  std::map<std::pair<std::string, unsigned>, uint64_t> LineSamples;
+
+  // Samples per function, line offset and discriminator
+  StringMap<std::map<std::pair<unsigned, unsigned>, uint64_t>>
+      OffsetSamples;
+
+  uint64_t Total = 0;
+};
+
+// Static HTML report with a sortable table of all the loops and a
+// collapsible loop nest per function. Table rows are written as the
+// loops are analysed and the loop nest of a function once all of its
+// loops are done, so only the loops of one function are kept in
+// memory and the browser can show the page while it is still loading.
+class HTMLReport {
+public:
+  bool open(StringRef Filename, std::string &Error);
+
+  // Read the LICMNA hoist remarks of a YAML remarks file
+  bool loadRemarks(StringRef Filename, std::string &Error);
+
+  void addLoop(int ID, const LoopRecord &Record, Loop *L);
+
+  // Write the loop nest of the function whose loops were added last
+  void finishFunction();
+
+  void close();
+
+private:
+  struct Node {
+    int ID;
+    const Loop *L;
+    const Loop *Parent;
+    std::string Summary;
+    std::string Snippet;
+    std::vector<std::string> Hoisted;
+  };
+
+  struct SourceFile {
+    std::unique_ptr<MemoryBuffer> Buffer;
+    std::vector<StringRef> Lines;
+  };
+
+  // Get the source lines of the loop, empty without debug info
+  std::string getSnippet(Loop *L);
+
+  void writeNode(const Node &N, const DenseMap<const Loop *, size_t> &Index);
+  void flushRows();
+
+  std::unique_ptr<raw_fd_ostream> OS;
+
+  // Table rows not written yet, they are written in batches to keep
+  // the number of script elements down
+  std::string Rows;
+  unsigned NumRows = 0;
+
+  std::string Function;
+  std::vector<Node> Nodes;
+
+  // Hoisted instructions per function and loop header name
+  std::map<std::pair<std::string, std::string>, std::vector<std::string>>
+      Remarks;
+
+  // Source files read for snippets, null when they cannot be read
+  StringMap<std::unique_ptr<SourceFile>> Sources;
+};
+
+// Result of evaluating a filter, Unknown when it depends on metrics
+// that have not been computed yet
+enum class FilterResult { False, True, Unknown };
+
+// Compiled loop filter expression. Comparisons of a record field with
+// a number, true/false or a string can be combined with &&, || and !,
+// and func can be matched against a regular expression with =~ / !~.
+class LoopFilter {
+public:
+  // Parse an expression, returns nullptr and sets Error on failure
+  static std::unique_ptr<LoopFilter> compile(StringRef Text,
+                                             std::string &Error);
+
+  // Evaluate the filter on a record, if Partial only the function name
+  // and depth of the record are valid
+  FilterResult evaluate(const LoopRecord &Record, bool Partial) const;
+
+private:
+  enum class Field {
+    Func,
+    Depth,
+    SubLoops,
+    BBs,
+    Instrs,
+    Atomics,
+    Branches,
+    IVs,
+    CanonicalIV,
+    Exiting,
+    Exits,
+    LatchOnlyExit,
+    RecMII,
+    LatencyBound,
+    Loads,
+    IndependentLoads,
+    LoadChain,
+    VectorInstrs,
+    ScalarInstrs,
+    VectorBits,
+    MaskedOps,
+    GatherScatter,
+    SyncCalls,
+    IOCalls,
+    Samples
+  };
+  enum class Op { EQ, NE, LT, LE, GT, GE, Match, NoMatch };
+
+  struct Node {
+    enum { And, Or, Not, Compare } Kind;
+    std::unique_ptr<Node> LHS, RHS;
+
+    // Only used by comparisons
+    Field F = Field::Depth;
+    Op O = Op::EQ;
+    int64_t Number = 0;
+    std::string String;
+    std::unique_ptr<Regex> Pattern;
+  };
+
+  class Parser;
+
+  FilterResult evaluate(const Node &N, const LoopRecord &Record,
+                        bool Partial) const;
+  static int64_t getNumber(const LoopRecord &Record, Field F);
+
+  std::unique_ptr<Node> Root;
+};
+
+// Structural metrics of loops, shared by the legacy pass and the new
+// pass manager analysis
+class LoopMetrics {
+public:
+  // Compute all the structural metrics of the loop, the IV widths
+  // are stored in Allocator
+  void analyse(Loop *L, ScalarEvolution *SE, const TargetTransformInfo *TTI,
+               BumpPtrAllocator &Allocator, LoopRecord &Record) const;
 
   // Get the name of the Function containing the loop
   StringRef getFunctionName(Loop *L) const;
@@ -28,6 +403,36 @@ private:
   // Get the depth of a nested loop, 0 for a non-nested loop
   int getDepth(Loop *L) const;
 
+  // Get a hash of the loop body that only depends on its structure:
+  // opcodes, types, constants and how values flow between
+  // instructions, with commutative operands put in a canonical order
+  stable_hash getFingerprint(Loop *L, const LoopInfo *LI) const;
+
+  // Get the unroll count recommended for an innermost loop from its
+  // size, trip count, register pressure and recurrences, or 0 for
+  // other loops
+  int getUnrollCount(Loop *L, ScalarEvolution *SE,
+                     const LoopRecord &Record) const;
+
+  // Count the calls of the loop that may block on a lock or on I/O.
+  // Loops with the same fingerprint can call different functions, so
+  // they do not share these.
+  void getBlockingCalls(Loop *L, const TargetLibraryInfo *TLI,
+                        LoopRecord &Record) const;
+
+  // Get the source location of the loop from its debug info, which
+  // loops with the same fingerprint do not share either
+  void getLocation(Loop *L, LoopRecord &Record) const;
+
+  // Forget the values numbered for the fingerprints, which may be
+  // deleted along with their function
+  void reset() {
+    LocalValues.clear();
+    ExternalValues.clear();
+    ChainLengths.clear();
+  }
+
+private:
   // Check if a loop contains any nested loops
   bool hasNestedLoops(Loop *L) const;
 
@@ -57,53 +462,603 @@ private:
   // or llvm::SwitchInst
   bool isBranchInstruction(const Instruction &I) const;
 
-  // Print the obtained loop information
-  void print(StringRef function, int depth, bool subLoops, int blocks,
-             int instructions, int atomics, int branches) const;
+  // Get the bit widths of the header phis that SCEV recognizes as
+  // add recurrences of this loop, i.e. its induction variables, stored
+  // in Allocator
+  ArrayRef<unsigned> getIVWidths(Loop *L, ScalarEvolution *SE,
+                                 BumpPtrAllocator &Allocator) const;
+
+  // Check if the loop has a canonical induction variable, one that
+  // starts at 0 and is incremented by 1 every iteration
+  bool hasCanonicalIV(Loop *L) const;
+
+  // Get the number of blocks inside the loop that branch out of it
+  int getNumExitingBlocks(Loop *L) const;
+
+  // Get the number of unique blocks outside the loop that are
+  // branched to from inside of it
+  int getNumExitBlocks(Loop *L) const;
+
+  // Check if the latch is the only block the loop can exit from
+  bool isLatchOnlyExit(Loop *L) const;
+
+  // Get the latency in cycles of the longest recurrence of an innermost
+  // loop, or 0 for other loops, and that of the longest one that is
+  // neither an induction variable nor a pointer chase in ReductionMII
+  unsigned getRecMII(Loop *L, ScalarEvolution *SE,
+                     const TargetTransformInfo *TTI,
+                     unsigned &ReductionMII) const;
+
+  // Get the latency of the longest chain of instructions leading from
+  // a header phi to a value within one iteration of an innermost loop,
+  // -1 if the value does not depend on the phi
+  int getLatencyFrom(const PHINode *Phi, const Value *V, Loop *L,
+                     const TargetTransformInfo *TTI) const;
+
+  // Get the most loads on a chain of addresses leading from a header
+  // phi to a value within one iteration of an innermost loop, -1 if
+  // the value does not depend on the phi
+  int getLoadsFrom(const PHINode *Phi, const Value *V, Loop *L) const;
+
+  // Count the loads of the loop outside its subloops, those of them
+  // whose address depends on no other load, and the loads on the
+  // longest chain of loads each computing the address of the next
+  void getLoadParallelism(Loop *L, LoopRecord &Record) const;
+
+  // Get the number of loads on the longest chain of loads leading to a
+  // value of the loop within one iteration. With Carried the header
+  // phis in ValueScratch count as a load of the previous iteration,
+  // otherwise as none.
+  int getLoadDepth(const Value *V, Loop *L, bool Carried) const;
+
+  // Count the arithmetic and memory instructions of the loop on vector
+  // and on scalar types, the vector ones by width, and the masked
+  // loads and stores
+  void getVectorMix(Loop *L, LoopRecord &Record) const;
+
+  // Get the type an arithmetic or memory instruction computes or
+  // accesses, or null for other instructions
+  Type *getOperationType(const Instruction &I) const;
+
+  // Get the number of values defined outside the loop that it uses
+  unsigned getNumLiveIns(Loop *L) const;
+
+  // Get the largest number of values defined in a block of the loop
+  // that are live at once in it, the registers one copy of the body
+  // needs on top of the live-ins
+  unsigned getMaxLive(Loop *L) const;
+
+  // Get a hash of a type that is stable across modules
+  stable_hash hashType(Type *Ty) const;
+
+  // Get a hash of a value used as an operand, instructions and blocks
+  // of the loop are hashed by their position, globals and functions by
+  // their name or intrinsic ID, and the other values defined outside
+  // of the loop by the order in which they are first used
+  stable_hash hashOperand(const Value *V, unsigned &NumExternal) const;
+
+  // Scratch space reused from loop to loop so that analysing a loop
+  // does not allocate once it has grown to the largest loop seen
+  mutable SmallVector<unsigned, 8> WidthScratch;
+  mutable SmallVector<BasicBlock *, 8> BlockScratch;
+  mutable SmallPtrSet<const Value *, 32> ValueScratch;
+
+  // Numbering of the values of a loop for its fingerprint. Entries are
+  // tagged with the loop they were made for instead of clearing the
+  // maps before every loop, which could shrink them.
+  mutable DenseMap<const Value *, std::pair<unsigned, unsigned>>
+      LocalValues;
+  mutable DenseMap<const Value *, std::pair<unsigned, unsigned>>
+      ExternalValues;
+  mutable unsigned FingerprintGeneration = 0;
+
+  // Lengths of the longest dependence chains ending in the values of a
+  // loop, latencies from a header phi or numbers of loads, tagged with
+  // the walk they were computed in like the fingerprint numbering
+  mutable DenseMap<const Value *, std::pair<unsigned, int>> ChainLengths;
+  mutable unsigned ChainGeneration = 0;
+}; // end of class LoopMetrics
+
+class LoopInfoNA : public LoopPass {
+public:
+  static char ID;
+
+  LoopInfoNA();
+  explicit LoopInfoNA(LoopRecordSink Sink);
+  ~LoopInfoNA() override;
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+  bool runOnLoop(Loop *L, LPPassManager &LPM) override;
+  bool doFinalization() override;
+
+private:
+  // Global loop counter used as an ID
+  int numLoops;
+
+  // Receives the reported loops instead of them being printed, the
+  // module level reports are left out when it is set
+  LoopRecordSink Sink;
+
+  // Records of the loops of the current function, reset once all of
+  // its loops are done
+  BumpPtrAllocator RecordAllocator;
+
+  // Memory that lives as long as the pass: the IV widths of the
+  // fingerprinted records and the interned function names
+  BumpPtrAllocator PersistentAllocator;
+  UniqueStringSaver FunctionNames{PersistentAllocator};
+
+  // Metrics of the loops and the line printed for the sink, reused
+  // from loop to loop
+  LoopMetrics Metrics;
+  std::string LineScratch;
+
+  // Records of the loops analysed so far, keyed by their fingerprint
+  DenseMap<stable_hash, FingerprintEntry> Fingerprints;
+
+  // Compiled -loopinfona-filter expression, null when not given
+  std::unique_ptr<LoopFilter> Selection;
+
+  // Profile given with -loopinfona-profile, null when not given
+  std::unique_ptr<LoopProfile> Samples;
+
+  // Report written with -loopinfona-html, null when not given
+  std::unique_ptr<HTMLReport> Report;
+
+  // Function whose loops are being analysed, whether it was picked by
+  // the sampling and the totals of its loops so far
+  const Function *CurrentFunction = nullptr;
+  bool CurrentSampled = true;
+  unsigned CurrentStratum = 0;
+  double CurrentTotals[array_lengthof(SummaryMetrics) + 1] = {};
+
+  // Sampling statistics, keyed by function size class
+  std::map<unsigned, SampleStratum> Strata;
+
+  // Start analysing the loops of a new function and decide if it is
+  // part of the sample
+  void startFunction(const Function &F);
+
+  // Add the loops totals of the current function to its stratum
+  void finishFunction();
+
+  // Print the extrapolated totals with their 95% confidence intervals
+  void printEstimates() const;
+
+  // Orders the keys of the histograms, which can be looked up by a
+  // StringRef name so that adding a loop does not copy the names
+  struct SummaryKeyLess {
+    using is_transparent = void;
+    template <typename A, typename B>
+    bool operator()(const A &LHS, const B &RHS) const {
+      return std::make_pair(StringRef(LHS.first), LHS.second) <
+             std::make_pair(StringRef(RHS.first), RHS.second);
+    }
+  };
+
+  // Histograms of every metric, keyed by metric name and loop depth
+  std::map<std::pair<std::string, int>, Histogram, SummaryKeyLess>
+      Summaries;
+
+  // Get the histogram of a metric at a loop depth, creating it if
+  // needed
+  Histogram &getSummary(StringRef Metric, int Depth);
+
+  // Add the metrics of a loop to the summary histograms
+  void addToSummary(const LoopRecord &Record);
+
+  // Merge the summary histograms stored in a file
+  void readSummary(StringRef Filename);
+
+  // Store the summary histograms in a file
+  void writeSummary(StringRef Filename) const;
+
+  // Print the quantiles of every summary histogram
+  void printSummary() const;
+
+  // Print the number of unique fingerprints and the ones seen more
+  // than once
+  void printDuplicates() const;
 
 }; // end of class LoopInfoNA
 
+// Structural metrics of a loop for the new pass manager. Passes that
+// change a loop drop its results unless they declare them preserved,
+// also when they only touched the preheader or the exits, so the result
+// keeps the fingerprint of the body it was computed for and survives as
+// long as the body does not change.
+class LoopStatsAnalysis : public AnalysisInfoMixin<LoopStatsAnalysis> {
+public:
+  class Result {
+  public:
+    // Get the statistics of L, computed again first if a loop inside
+    // of it changed since. Passes only invalidate the results of the
+    // loop they ran on, even when that also changed the loops around it.
+    const LoopRecord &getRecord(Loop &L, LoopAnalysisManager &AM,
+                                LoopStandardAnalysisResults &AR);
+
+    bool invalidate(Loop &L, const PreservedAnalyses &PA,
+                    LoopAnalysisManager::Invalidator &Inv);
+
+  private:
+    friend LoopStatsAnalysis;
+
+    explicit Result(DenseMap<const Loop *, unsigned> &InnerChanges)
+        : InnerChanges(&InnerChanges) {}
+
+    void compute(Loop &L, LoopAnalysisManager &AM,
+                 LoopStandardAnalysisResults &AR);
+
+    LoopRecord Record;
+    // The IV widths of Record, which is only handed out with its
+    // IVWidths pointing here, so that results can be copied
+    std::vector<unsigned> IVWidths;
+    // The changes of the loops inside of this one, as counted by the
+    // analysis, when the statistics were computed
+    unsigned Changes = 0;
+    DenseMap<const Loop *, unsigned> *InnerChanges;
+  };
+
+  Result run(Loop &L, LoopAnalysisManager &AM,
+             LoopStandardAnalysisResults &AR);
+
+private:
+  friend AnalysisInfoMixin<LoopStatsAnalysis>;
+  static AnalysisKey Key;
+
+  // How often the results of loops nested in each loop were
+  // invalidated, the results of the outer loops are computed again
+  // when this changed
+  DenseMap<const Loop *, unsigned> InnerChanges;
+};
+
+// Prints the statistics of every loop it is run on, the new pass
+// manager counterpart of LoopInfoNA
+class LoopInfoNAPrinterPass : public PassInfoMixin<LoopInfoNAPrinterPass> {
+public:
+  PreservedAnalyses run(Loop &L, LoopAnalysisManager &AM,
+                        LoopStandardAnalysisResults &AR, LPMUpdater &U);
+
+private:
+  int NumLoops = 0;
+};
+
 } // end of anonymous namespace
 
+// Print the obtained loop information, Profile is the one the samples
+// were taken from if any
+static void printRecord(raw_ostream &OS, int ID, const LoopRecord &Record,
+                        const LoopProfile *Profile) {
+  OS << ID << ": ";
+  OS << "func=" << Record.Function << ", ";
+  OS << "depth=" << Record.Depth << ", ";
+  OS << "subLoops=" << (Record.SubLoops ? "true" : "false") << ", ";
+  OS << "BBs=" << Record.Blocks << ", ";
+  OS << "instrs=" << Record.Instructions << ", ";
+  OS << "atomics=" << Record.Atomics << ", ";
+  OS << "branches=" << Record.Branches << ", ";
+  OS << "IVs=" << Record.IVWidths.size() << ", ";
+  OS << "IVWidths=[";
+  for (size_t i = 0; i < Record.IVWidths.size(); ++i) {
+    OS << (i ? "," : "") << Record.IVWidths[i];
+  }
+  OS << "], ";
+  OS << "canonicalIV=" << (Record.CanonicalIV ? "true" : "false") << ", ";
+  OS << "exiting=" << Record.ExitingBlocks << ", ";
+  OS << "exits=" << Record.ExitBlocks << ", ";
+  OS << "latchOnlyExit=" << (Record.LatchOnlyExit ? "true" : "false")
+     << ", ";
+  OS << "recMII=" << Record.RecMII << ", ";
+  OS << "latencyBound=" << (Record.LatencyBound ? "true" : "false")
+     << ", ";
+  OS << "loads=" << Record.Loads << ", ";
+  OS << "independentLoads=" << Record.IndependentLoads << ", ";
+  OS << "loadChain=" << Record.LoadChain << ", ";
+  int Operations = Record.VectorInstructions + Record.ScalarInstructions;
+  OS << "vectorInstrs=" << Record.VectorInstructions << ", ";
+  OS << "scalarInstrs=" << Record.ScalarInstructions << ", ";
+  OS << "vectorPct="
+     << format("%.2f", Operations ? 100.0 * Record.VectorInstructions /
+                                        Operations
+                                  : 0.0)
+     << ", ";
+  OS << "vectorWidths=[";
+  bool First = true;
+  for (unsigned i = 0; i < LoopRecord::NumVectorWidths; ++i) {
+    if (Record.VectorWidths[i]) {
+      OS << (First ? "" : ",") << (64 << i) << ':' << Record.VectorWidths[i];
+      First = false;
+    }
+  }
+  OS << "], ";
+  OS << "maskedOps=" << Record.MaskedOps << ", ";
+  OS << "gatherScatter=" << Record.GatherScatter << ", ";
+  OS << "syncCalls=" << Record.SyncCalls << ", ";
+  OS << "ioCalls=" << Record.IOCalls;
+  if (Record.Line) {
+    OS << ", loc=" << Record.File << ':' << Record.Line;
+  }
+  if (UnrollHints) {
+    OS << ", unroll=" << Record.UnrollCount;
+  }
+  if (Profile) {
+    double Percent = Profile->getTotal()
+                         ? 100.0 * Record.Samples / Profile->getTotal()
+                         : 0.0;
+    OS << ", samples=" << Record.Samples
+           << ", samplesPct=" << format("%.2f", Percent);
+  }
+  if (Dedup) {
+    OS << ", fingerprint=" << format_hex(Record.Fingerprint, 18);
+    if (Record.DuplicateOf != -1) {
+      OS << ", duplicateOf=" << Record.DuplicateOf;
+    }
+  }
+  OS << '\n';
+}
+
 char LoopInfoNA::ID = 0;
 
 static RegisterPass<LoopInfoNA> X("LoopInfoNA", "LoopInfoNA Pass",
                                false /* Only looks at CFG */,
                                false /* Analysis Pass */);
 
-LoopInfoNA::LoopInfoNA() : LoopPass(ID), numLoops(0) {}
+Pass *createLoopInfoNAPass(LoopRecordSink Sink) {
+  return new LoopInfoNA(std::move(Sink));
+}
+
+LoopInfoNA::LoopInfoNA() : LoopInfoNA(nullptr) {}
+
+LoopInfoNA::LoopInfoNA(LoopRecordSink Sink)
+    : LoopPass(ID), numLoops(0), Sink(std::move(Sink)) {
+  if (!Filter.empty()) {
+    std::string Error;
+    Selection = LoopFilter::compile(Filter, Error);
+    if (!Selection) {
+      report_fatal_error(Twine("LoopInfoNA: invalid filter: ") + Error,
+                         false);
+    }
+  }
+
+  if (!Profile.empty()) {
+    std::string Error;
+    Samples = std::make_unique<LoopProfile>();
+    if (!Samples->load(Profile, Error)) {
+      report_fatal_error(Twine("LoopInfoNA: cannot read profile ") +
+                             Profile + ": " + Error,
+                         false);
+    }
+  }
+
+  if (!HTML.empty() && !this->Sink) {
+    std::string Error;
+    Report = std::make_unique<HTMLReport>();
+    if (!Report->open(HTML, Error) ||
+        (!HTMLRemarks.empty() && !Report->loadRemarks(HTMLRemarks, Error))) {
+      report_fatal_error(Twine("LoopInfoNA: cannot write report ") + HTML +
+                             ": " + Error,
+                         false);
+    }
+  }
+}
+
+// Module level finalization is not run for loop passes, so the
+// duplicates and summaries are reported once the pass manager is
+// destroyed
+LoopInfoNA::~LoopInfoNA() {
+  if (Sink) {
+    return;
+  }
+
+  if (Report) {
+    Report->close();
+  }
+
+  if (SampleFraction < 1.0) {
+    printEstimates();
+  }
+
+  if (Dedup) {
+    printDuplicates();
+  }
+
+  if (Summary || !SummaryOut.empty()) {
+    for (const std::string &Filename : SummaryIn) {
+      readSummary(Filename);
+    }
+    if (!SummaryOut.empty()) {
+      writeSummary(SummaryOut);
+    }
+    if (Summary) {
+      printSummary();
+    }
+  }
+}
+
+void LoopInfoNA::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<ScalarEvolutionWrapperPass>();
+  AU.addRequired<TargetTransformInfoWrapperPass>();
+  AU.addRequired<TargetLibraryInfoWrapperPass>();
+}
 
 bool LoopInfoNA::runOnLoop(Loop *L, LPPassManager &LPM) {
-  StringRef function = getFunctionName(L);
-  int depth = getDepth(L);
-  bool hasNested = hasNestedLoops(L);
-  int blocks = getNumBlocks(L);
-  int instructions = getNumInstructions(L);
-  int atomics = getNumAtomics(L);
-  int branches = getNumBranches(L);
-
-  print(function, depth, hasNested, blocks, instructions, atomics, branches);
+  // The detail is only built when tracing, so that analysing a loop
+  // still does not allocate
+  TimeTraceScope TimeScope("LoopInfoNA", [&] {
+    return (L->getHeader()->getParent()->getName() + ":" + L->getName())
+        .str();
+  });
+
+  if (SampleFraction < 1.0) {
+    const Function *F = L->getHeader()->getParent();
+    if (F != CurrentFunction) {
+      startFunction(*F);
+    }
+    if (!CurrentSampled) {
+      this->numLoops++;
+      return false;
+    }
+  }
+
+  LoopRecord &Record = *new (RecordAllocator) LoopRecord();
+  Record.Function = Metrics.getFunctionName(L);
+  Record.Depth = Metrics.getDepth(L);
+
+  // Skip the metrics when the function name and depth already rule
+  // the loop out
+  if (Selection &&
+      Selection->evaluate(Record, true) == FilterResult::False) {
+    this->numLoops++;
+    return false;
+  }
+
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  const TargetTransformInfo *TTI =
+      &getAnalysis<TargetTransformInfoWrapperPass>().getTTI(
+          *L->getHeader()->getParent());
+  if (!Dedup) {
+    Metrics.analyse(L, SE, TTI, RecordAllocator, Record);
+  } else {
+    LoopInfo *LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+    stable_hash Fingerprint = Metrics.getFingerprint(L, LI);
+    auto It = Fingerprints.find(Fingerprint);
+    if (It != Fingerprints.end()) {
+      Record = It->second.Record;
+      Record.Function = Metrics.getFunctionName(L);
+      Record.Depth = Metrics.getDepth(L);
+      Record.DuplicateOf = It->second.FirstID;
+      It->second.Count++;
+    } else {
+      Metrics.analyse(L, SE, TTI, RecordAllocator, Record);
+      Record.Fingerprint = Fingerprint;
+
+      // The cached record outlives the function, so its IV widths are
+      // copied out of the per function allocator
+      FingerprintEntry Entry = {Record, this->numLoops, 1,
+                                FunctionNames.save(Record.Function)};
+      unsigned *Widths =
+          PersistentAllocator.Allocate<unsigned>(Record.IVWidths.size());
+      std::copy(Record.IVWidths.begin(), Record.IVWidths.end(), Widths);
+      Entry.Record.IVWidths = makeArrayRef(Widths, Record.IVWidths.size());
+      Fingerprints[Fingerprint] = Entry;
+    }
+  }
+
+  Metrics.getBlockingCalls(
+      L,
+      &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(
+          *L->getHeader()->getParent()),
+      Record);
+  Metrics.getLocation(L, Record);
+
+  // Samples depend on the debug locations, so they are not shared
+  // between loops with the same fingerprint
+  if (Samples) {
+    Record.Samples = Samples->getSamples(L);
+  }
+
+  if (Selection &&
+      Selection->evaluate(Record, false) != FilterResult::True) {
+    this->numLoops++;
+    return false;
+  }
+
+  // Unroll counts are not shared either, the trip counts of loops with
+  // the same fingerprint may differ with the values they get from
+  // outside. Only the reported loops get one, and unroll pragmas are
+  // left alone.
+  bool Modified = false;
+  if (UnrollHints) {
+    Record.UnrollCount = Metrics.getUnrollCount(L, SE, Record);
+    if (Record.UnrollCount && hasUnrollTransformation(L) == TM_Unspecified) {
+      addStringMetadataToLoop(L, "llvm.loop.unroll.count",
+                              Record.UnrollCount);
+      Modified = true;
+    }
+  }
+
+  if (SampleFraction < 1.0) {
+    for (size_t i = 0; i < array_lengthof(SummaryMetrics); ++i) {
+      CurrentTotals[i] += SummaryMetrics[i].Get(Record);
+    }
+    CurrentTotals[array_lengthof(SummaryMetrics)]++;
+  }
+  if (Summary || !SummaryOut.empty()) {
+    addToSummary(Record);
+  }
+  if (Report) {
+    Report->addLoop(this->numLoops, Record, L);
+  }
+  if (Sink) {
+    LineScratch.clear();
+    raw_string_ostream OS(LineScratch);
+    printRecord(OS, this->numLoops, Record, Samples.get());
+    Sink(this->numLoops, Record, StringRef(OS.str()).rtrim('\n'));
+  } else if (!Summary) {
+    printRecord(errs(), this->numLoops, Record, Samples.get());
+  }
   this->numLoops++;
 
+  return Modified;
+}
+
+bool LoopInfoNA::doFinalization() {
+  if (CurrentFunction) {
+    finishFunction();
+  }
+  if (Report) {
+    Report->finishFunction();
+  }
+
+  RecordAllocator.Reset();
+  Metrics.reset();
+
   return false;
 }
 
-StringRef LoopInfoNA::getFunctionName(Loop *L) const {
+void LoopMetrics::analyse(Loop *L, ScalarEvolution *SE,
+                          const TargetTransformInfo *TTI,
+                          BumpPtrAllocator &Allocator,
+                          LoopRecord &Record) const {
+  Record.Function = getFunctionName(L);
+  Record.Depth = getDepth(L);
+  Record.SubLoops = hasNestedLoops(L);
+  Record.Blocks = getNumBlocks(L);
+  Record.Instructions = getNumInstructions(L);
+  Record.Atomics = getNumAtomics(L);
+  Record.Branches = getNumBranches(L);
+  Record.IVWidths = getIVWidths(L, SE, Allocator);
+  Record.CanonicalIV = hasCanonicalIV(L);
+  Record.ExitingBlocks = getNumExitingBlocks(L);
+  Record.ExitBlocks = getNumExitBlocks(L);
+  Record.LatchOnlyExit = isLatchOnlyExit(L);
+
+  // The body of a loop issues in instrs / issue width cycles at best,
+  // a reduction with a longer recurrence leaves the issue slots idle
+  unsigned ReductionMII;
+  Record.RecMII = getRecMII(L, SE, TTI, ReductionMII);
+  Record.LatencyBound =
+      ReductionMII > divideCeil(Record.Instructions,
+                                std::max(IssueWidth.getValue(), 1u));
+  getLoadParallelism(L, Record);
+  getVectorMix(L, Record);
+}
+
+StringRef LoopMetrics::getFunctionName(Loop *L) const {
   BasicBlock *header = L->getHeader();
   Function *F = header->getParent();
 
   return F->getName();
 }
 
-int LoopInfoNA::getDepth(Loop *L) const { return L->getLoopDepth() - 1; }
+int LoopMetrics::getDepth(Loop *L) const { return L->getLoopDepth() - 1; }
 
-bool LoopInfoNA::hasNestedLoops(Loop *L) const {
-  auto subLoops = L->getSubLoops();
-
-  return subLoops.size() != 0;
+bool LoopMetrics::hasNestedLoops(Loop *L) const {
+  return !L->getSubLoops().empty();
 }
 
-int LoopInfoNA::getNumBlocks(Loop *L) const {
+int LoopMetrics::getNumBlocks(Loop *L) const {
   int count = 0;
   for (const BasicBlock *BB : L->blocks()) {
     if (!isInSubLoop(L, BB)) {
@@ -114,7 +1069,7 @@ int LoopInfoNA::getNumBlocks(Loop *L) const {
   return count;
 }
 
-int LoopInfoNA::getNumInstructions(Loop *L) const {
+int LoopMetrics::getNumInstructions(Loop *L) const {
   int count = 0;
   for (const BasicBlock *bb : L->blocks()) {
     count += bb->size();
@@ -123,7 +1078,7 @@ int LoopInfoNA::getNumInstructions(Loop *L) const {
   return count;
 }
 
-int LoopInfoNA::getNumAtomics(Loop *L) const {
+int LoopMetrics::getNumAtomics(Loop *L) const {
   int count = 0;
   for (const BasicBlock *bb : L->blocks()) {
     for (const Instruction &instr : bb->getInstList()) {
@@ -136,7 +1091,7 @@ int LoopInfoNA::getNumAtomics(Loop *L) const {
   return count;
 }
 
-bool LoopInfoNA::isAtomic(const Instruction &I) const {
+bool LoopMetrics::isAtomic(const Instruction &I) const {
   if (I.isAtomic()) {
     return true;
   }
@@ -144,7 +1099,7 @@ bool LoopInfoNA::isAtomic(const Instruction &I) const {
   return false;
 }
 
-int LoopInfoNA::getNumBranches(Loop *L) const {
+int LoopMetrics::getNumBranches(Loop *L) const {
   int count = 0;
   for (const BasicBlock *bb : L->blocks()) {
     if (isInSubLoop(L, bb)) {
@@ -161,7 +1116,7 @@ int LoopInfoNA::getNumBranches(Loop *L) const {
   return count;
 }
 
-bool LoopInfoNA::isInSubLoop(Loop *L, const BasicBlock *BB) const {
+bool LoopMetrics::isInSubLoop(Loop *L, const BasicBlock *BB) const {
   for (const Loop *SL : L->getSubLoops()) {
     if (SL->contains(BB)) {
       return true;
@@ -171,7 +1126,7 @@ bool LoopInfoNA::isInSubLoop(Loop *L, const BasicBlock *BB) const {
   return false;
 }
 
-bool LoopInfoNA::isBranchInstruction(const Instruction &I) const {
+bool LoopMetrics::isBranchInstruction(const Instruction &I) const {
   switch (I.getOpcode()) {
   default:
     return false;
@@ -184,15 +1139,1920 @@ bool LoopInfoNA::isBranchInstruction(const Instruction &I) const {
   }
 }
 
-void LoopInfoNA::print(StringRef function, int depth, bool subLoops, int blocks,
-                    int instructions, int atomics, int branches) const {
-  errs() << this->numLoops << ": ";
-  errs() << "func=" << function << ", ";
-  errs() << "depth=" << depth << ", ";
-  std::string sub = subLoops ? "true" : "false";
-  errs() << "subLoops=" << sub << ", ";
-  errs() << "BBs=" << blocks << ", ";
-  errs() << "instrs=" << instructions << ", ";
-  errs() << "atomics=" << atomics << ", ";
-  errs() << "branches=" << branches << '\n';
-}
\ No newline at end of file
+ArrayRef<unsigned> LoopMetrics::getIVWidths(Loop *L, ScalarEvolution *SE,
+                                           BumpPtrAllocator &Allocator) const {
+  WidthScratch.clear();
+  for (PHINode &PN : L->getHeader()->phis()) {
+    if (!SE->isSCEVable(PN.getType())) {
+      continue;
+    }
+
+    const auto *AddRec = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(&PN));
+    if (AddRec && AddRec->getLoop() == L) {
+      WidthScratch.push_back(SE->getTypeSizeInBits(PN.getType()));
+    }
+  }
+
+  unsigned *Widths = Allocator.Allocate<unsigned>(WidthScratch.size());
+  std::copy(WidthScratch.begin(), WidthScratch.end(), Widths);
+  return makeArrayRef(Widths, WidthScratch.size());
+}
+
+bool LoopMetrics::hasCanonicalIV(Loop *L) const {
+  return L->getCanonicalInductionVariable() != nullptr;
+}
+
+int LoopMetrics::getNumExitingBlocks(Loop *L) const {
+  BlockScratch.clear();
+  L->getExitingBlocks(BlockScratch);
+
+  return BlockScratch.size();
+}
+
+int LoopMetrics::getNumExitBlocks(Loop *L) const {
+  BlockScratch.clear();
+  L->getUniqueExitBlocks(BlockScratch);
+
+  return BlockScratch.size();
+}
+
+bool LoopMetrics::isLatchOnlyExit(Loop *L) const {
+  BasicBlock *Latch = L->getLoopLatch();
+
+  return Latch && L->getExitingBlock() == Latch;
+}
+
+unsigned LoopMetrics::getRecMII(Loop *L, ScalarEvolution *SE,
+                                const TargetTransformInfo *TTI,
+                                unsigned &ReductionMII) const {
+  ReductionMII = 0;
+  if (!L->isInnermost()) {
+    return 0;
+  }
+
+  // Every cycle of an innermost loop goes through its header, so the
+  // recurrences are the paths from a header phi to its values coming
+  // from inside the loop
+  unsigned RecMII = 0;
+  for (const PHINode &PN : L->getHeader()->phis()) {
+    ++ChainGeneration;
+    int Latency = -1;
+    for (unsigned i = 0; i < PN.getNumIncomingValues(); ++i) {
+      if (L->contains(PN.getIncomingBlock(i))) {
+        Latency = std::max(
+            Latency, getLatencyFrom(&PN, PN.getIncomingValue(i), L, TTI));
+      }
+    }
+    if (Latency < 0) {
+      continue;
+    }
+
+    RecMII = std::max(RecMII, unsigned(Latency));
+    const SCEVAddRecExpr *AddRec = nullptr;
+    if (SE->isSCEVable(PN.getType())) {
+      AddRec = dyn_cast<SCEVAddRecExpr>(
+          SE->getSCEV(const_cast<PHINode *>(&PN)));
+    }
+    if (AddRec && AddRec->getLoop() == L) {
+      continue;
+    }
+
+    // A pointer chase cannot be split like a reduction, its next
+    // address is only known once the previous load completed
+    bool Chase = false;
+    ++ChainGeneration;
+    for (unsigned i = 0; i < PN.getNumIncomingValues() && !Chase; ++i) {
+      Chase = L->contains(PN.getIncomingBlock(i)) &&
+              getLoadsFrom(&PN, PN.getIncomingValue(i), L) > 0;
+    }
+    if (!Chase) {
+      ReductionMII = std::max(ReductionMII, unsigned(Latency));
+    }
+  }
+
+  return RecMII;
+}
+
+int LoopMetrics::getLatencyFrom(const PHINode *Phi, const Value *V, Loop *L,
+                                const TargetTransformInfo *TTI) const {
+  if (V == Phi) {
+    return 0;
+  }
+
+  // The other header phis carry their values over from the previous
+  // iteration, so they start recurrences of their own
+  const auto *I = dyn_cast<Instruction>(V);
+  if (!I || !L->contains(I) ||
+      (isa<PHINode>(I) && I->getParent() == L->getHeader())) {
+    return -1;
+  }
+
+  auto It = ChainLengths.find(I);
+  if (It != ChainLengths.end() && It->second.first == ChainGeneration) {
+    return It->second.second;
+  }
+
+  // Phis inside the body only select a path, the others add the
+  // latency the target gives them, 1 when it does not know it
+  int Latency = -1;
+  for (const Value *Op : I->operands()) {
+    Latency = std::max(Latency, getLatencyFrom(Phi, Op, L, TTI));
+  }
+  if (Latency >= 0 && !isa<PHINode>(I)) {
+    InstructionCost Cost =
+        TTI->getInstructionCost(I, TargetTransformInfo::TCK_Latency);
+    Latency += Cost.isValid() ? *Cost.getValue() : 1;
+  }
+
+  ChainLengths[I] = {ChainGeneration, Latency};
+  return Latency;
+}
+
+int LoopMetrics::getLoadsFrom(const PHINode *Phi, const Value *V,
+                              Loop *L) const {
+  if (V == Phi) {
+    return 0;
+  }
+
+  const auto *I = dyn_cast<Instruction>(V);
+  if (!I || !L->contains(I) ||
+      (isa<PHINode>(I) && I->getParent() == L->getHeader())) {
+    return -1;
+  }
+
+  auto It = ChainLengths.find(I);
+  if (It != ChainLengths.end() && It->second.first == ChainGeneration) {
+    return It->second.second;
+  }
+
+  // Only a load whose address depends on the phi continues the chain,
+  // the values it loads are summed by a reduction that can be split
+  int Loads = -1;
+  if (const auto *Load = dyn_cast<LoadInst>(I)) {
+    int Address = getLoadsFrom(Phi, Load->getPointerOperand(), L);
+    Loads = Address >= 0 ? Address + 1 : -1;
+  } else {
+    for (const Value *Op : I->operands()) {
+      Loads = std::max(Loads, getLoadsFrom(Phi, Op, L));
+    }
+  }
+
+  ChainLengths[I] = {ChainGeneration, Loads};
+  return Loads;
+}
+
+void LoopMetrics::getLoadParallelism(Loop *L, LoopRecord &Record) const {
+  // A header phi whose value from the previous iteration was loaded,
+  // e.g. the next node of a list, makes the loads using it wait for
+  // that load as well. Those are found first with the chains cut at
+  // the header phis.
+  ++ChainGeneration;
+  ValueScratch.clear();
+  for (const PHINode &PN : L->getHeader()->phis()) {
+    for (unsigned i = 0; i < PN.getNumIncomingValues(); ++i) {
+      if (L->contains(PN.getIncomingBlock(i)) &&
+          getLoadDepth(PN.getIncomingValue(i), L, false) > 0) {
+        ValueScratch.insert(&PN);
+        break;
+      }
+    }
+  }
+
+  ++ChainGeneration;
+  for (const BasicBlock *BB : L->blocks()) {
+    if (isInSubLoop(L, BB)) {
+      continue;
+    }
+
+    for (const Instruction &I : *BB) {
+      const auto *Load = dyn_cast<LoadInst>(&I);
+      if (!Load) {
+        continue;
+      }
+
+      Record.Loads++;
+      if (getLoadDepth(Load->getPointerOperand(), L, true) == 0) {
+        Record.IndependentLoads++;
+      }
+      Record.LoadChain =
+          std::max(Record.LoadChain, getLoadDepth(Load, L, true));
+    }
+  }
+}
+
+int LoopMetrics::getLoadDepth(const Value *V, Loop *L, bool Carried) const {
+  // Values of the subloops are computed in iterations of their own
+  const auto *I = dyn_cast<Instruction>(V);
+  if (!I || !L->contains(I) || isInSubLoop(L, I->getParent())) {
+    return 0;
+  }
+  if (isa<PHINode>(I) && I->getParent() == L->getHeader()) {
+    return Carried && ValueScratch.count(I) ? 1 : 0;
+  }
+
+  auto It = ChainLengths.find(I);
+  if (It != ChainLengths.end() && It->second.first == ChainGeneration) {
+    return It->second.second;
+  }
+
+  int Depth = 0;
+  for (const Value *Op : I->operands()) {
+    Depth = std::max(Depth, getLoadDepth(Op, L, Carried));
+  }
+  if (isa<LoadInst>(I)) {
+    Depth++;
+  }
+
+  ChainLengths[I] = {ChainGeneration, Depth};
+  return Depth;
+}
+
+void LoopMetrics::getVectorMix(Loop *L, LoopRecord &Record) const {
+  const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+  for (const BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      Type *Ty = getOperationType(I);
+      if (!Ty) {
+        continue;
+      }
+      if (!Ty->isVectorTy()) {
+        Record.ScalarInstructions++;
+        continue;
+      }
+
+      // Scalable vectors are counted at their minimum width, and odd
+      // widths with the next power of two
+      uint64_t Bits = DL.getTypeSizeInBits(Ty).getKnownMinSize();
+      unsigned Bucket = Bits <= 64 ? 0 : Log2_64_Ceil(Bits) - 6;
+      Record.VectorInstructions++;
+      Record.VectorWidths[std::min(Bucket,
+                                   LoopRecord::NumVectorWidths - 1)]++;
+
+      if (const auto *II = dyn_cast<IntrinsicInst>(&I)) {
+        switch (II->getIntrinsicID()) {
+        case Intrinsic::masked_gather:
+        case Intrinsic::masked_scatter:
+          Record.GatherScatter++;
+          LLVM_FALLTHROUGH;
+        case Intrinsic::masked_load:
+        case Intrinsic::masked_store:
+        case Intrinsic::masked_expandload:
+        case Intrinsic::masked_compressstore:
+          Record.MaskedOps++;
+          break;
+        default:
+          break;
+        }
+      }
+    }
+  }
+}
+
+Type *LoopMetrics::getOperationType(const Instruction &I) const {
+  // Casts to pointers only change how an address is typed
+  if (isa<CastInst>(I) && I.getType()->isPtrOrPtrVectorTy()) {
+    return nullptr;
+  }
+  if (isa<BinaryOperator>(I) || isa<UnaryOperator>(I) || isa<CastInst>(I) ||
+      isa<SelectInst>(I) || isa<LoadInst>(I)) {
+    return I.getType();
+  }
+  if (isa<CmpInst>(I)) {
+    return I.getOperand(0)->getType();
+  }
+  if (const auto *Store = dyn_cast<StoreInst>(&I)) {
+    return Store->getValueOperand()->getType();
+  }
+
+  const auto *II = dyn_cast<IntrinsicInst>(&I);
+  if (!II) {
+    return nullptr;
+  }
+  switch (II->getIntrinsicID()) {
+  case Intrinsic::masked_store:
+  case Intrinsic::masked_scatter:
+  case Intrinsic::masked_compressstore:
+    return II->getArgOperand(0)->getType();
+  case Intrinsic::masked_load:
+  case Intrinsic::masked_gather:
+  case Intrinsic::masked_expandload:
+    return II->getType();
+  default:
+    // Math intrinsics such as fma or sqrt
+    return isTriviallyVectorizable(II->getIntrinsicID()) ? II->getType()
+                                                         : nullptr;
+  }
+}
+
+// Get the names of the functions counted as synchronization calls, or
+// as I/O calls on top of the ones TargetLibraryInfo knows
+static const StringSet<> &getBlockingCallNames(bool IO) {
+  static const StringSet<> Sync = [] {
+    StringSet<> Names;
+    for (const char *Name :
+         {"pthread_mutex_lock", "pthread_mutex_timedlock",
+          "pthread_rwlock_rdlock", "pthread_rwlock_wrlock",
+          "pthread_rwlock_timedrdlock", "pthread_rwlock_timedwrlock",
+          "pthread_spin_lock", "pthread_cond_wait", "pthread_cond_timedwait",
+          "pthread_barrier_wait", "pthread_join", "sem_wait",
+          "sem_timedwait", "syscall", "sleep", "usleep", "nanosleep",
+          "clock_nanosleep", "sched_yield"}) {
+      Names.insert(Name);
+    }
+    for (const std::string &Name : SyncCalls) {
+      Names.insert(Name);
+    }
+    return Names;
+  }();
+  static const StringSet<> IONames = [] {
+    StringSet<> Names;
+    for (const std::string &Name : IOCalls) {
+      Names.insert(Name);
+    }
+    return Names;
+  }();
+
+  return IO ? IONames : Sync;
+}
+
+// Check if a library function does I/O, reading or writing files, the
+// terminal or the file system
+static bool isIOLibFunc(LibFunc F) {
+  switch (F) {
+  case LibFunc_read:
+  case LibFunc_write:
+  case LibFunc_pread:
+  case LibFunc_pwrite:
+  case LibFunc_open:
+  case LibFunc_printf:
+  case LibFunc_vprintf:
+  case LibFunc_puts:
+  case LibFunc_putchar:
+  case LibFunc_putchar_unlocked:
+  case LibFunc_perror:
+  case LibFunc_scanf:
+  case LibFunc_gets:
+  case LibFunc_getchar:
+  case LibFunc_getchar_unlocked:
+  case LibFunc_fopen:
+  case LibFunc_fdopen:
+  case LibFunc_fclose:
+  case LibFunc_fflush:
+  case LibFunc_fprintf:
+  case LibFunc_vfprintf:
+  case LibFunc_fscanf:
+  case LibFunc_fputc:
+  case LibFunc_fputc_unlocked:
+  case LibFunc_fputs:
+  case LibFunc_fputs_unlocked:
+  case LibFunc_putc:
+  case LibFunc_putc_unlocked:
+  case LibFunc_fwrite:
+  case LibFunc_fwrite_unlocked:
+  case LibFunc_fgetc:
+  case LibFunc_fgetc_unlocked:
+  case LibFunc_getc:
+  case LibFunc_getc_unlocked:
+  case LibFunc_fgets:
+  case LibFunc_fgets_unlocked:
+  case LibFunc_fread:
+  case LibFunc_fread_unlocked:
+  case LibFunc_fseek:
+  case LibFunc_fseeko:
+  case LibFunc_ftell:
+  case LibFunc_ftello:
+  case LibFunc_popen:
+  case LibFunc_pclose:
+  case LibFunc_system:
+  case LibFunc_tmpfile:
+  case LibFunc_stat:
+  case LibFunc_fstat:
+  case LibFunc_lstat:
+  case LibFunc_statvfs:
+  case LibFunc_fstatvfs:
+  case LibFunc_opendir:
+  case LibFunc_closedir:
+  case LibFunc_readlink:
+  case LibFunc_unlink:
+  case LibFunc_remove:
+  case LibFunc_rename:
+  case LibFunc_mkdir:
+  case LibFunc_rmdir:
+  case LibFunc_chmod:
+    return true;
+  default:
+    return false;
+  }
+}
+
+void LoopMetrics::getBlockingCalls(Loop *L, const TargetLibraryInfo *TLI,
+                                   LoopRecord &Record) const {
+  Record.SyncCalls = 0;
+  Record.IOCalls = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      const auto *Call = dyn_cast<CallBase>(&I);
+      const Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+      if (!Callee) {
+        continue;
+      }
+
+      LibFunc F;
+      if (getBlockingCallNames(false).count(Callee->getName())) {
+        Record.SyncCalls++;
+      } else if ((TLI->getLibFunc(*Callee, F) && isIOLibFunc(F)) ||
+                 getBlockingCallNames(true).count(Callee->getName())) {
+        Record.IOCalls++;
+      }
+    }
+  }
+}
+
+void LoopMetrics::getLocation(Loop *L, LoopRecord &Record) const {
+  DebugLoc Loc = L->getStartLoc();
+  if (Loc) {
+    Record.File = Loc->getFilename();
+    Record.Line = Loc.getLine();
+  } else {
+    Record.File = "";
+    Record.Line = 0;
+  }
+}
+
+int LoopMetrics::getUnrollCount(Loop *L, ScalarEvolution *SE,
+                                const LoopRecord &Record) const {
+  if (!L->isInnermost()) {
+    return 0;
+  }
+
+  // Reductions are bound by the latency of their recurrence, which
+  // more copies hide once the reassociation passes split it
+  auto Phis = L->getHeader()->phis();
+  unsigned Recurrences =
+      std::distance(Phis.begin(), Phis.end()) - Record.IVWidths.size();
+  unsigned Budget = Recurrences ? 2 * UnrollBudget : UnrollBudget;
+  unsigned Size = std::max(Record.Instructions, 1);
+  unsigned Count = PowerOf2Floor(std::max(Budget / Size, 1u));
+
+  // Every copy keeps its own temporaries live, the live-ins are shared
+  unsigned LiveIns = getNumLiveIns(L);
+  unsigned MaxLive = getMaxLive(L);
+  while (Count > 1 && LiveIns + Count * MaxLive > UnrollRegisters) {
+    Count /= 2;
+  }
+
+  // A short loop is unrolled fully, a longer one by a count dividing
+  // its trip count so that no remainder loop is needed
+  unsigned TripCount = SE->getSmallConstantTripCount(L);
+  unsigned MaxTripCount = SE->getSmallConstantMaxTripCount(L);
+  if (TripCount && TripCount <= Count) {
+    return TripCount;
+  }
+  if (MaxTripCount && MaxTripCount < Count) {
+    Count = PowerOf2Floor(MaxTripCount);
+  }
+  while (TripCount && TripCount % Count) {
+    Count /= 2;
+  }
+
+  return Count;
+}
+
+unsigned LoopMetrics::getNumLiveIns(Loop *L) const {
+  ValueScratch.clear();
+  for (const BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      for (const Value *Op : I.operands()) {
+        if ((isa<Instruction>(Op) || isa<Argument>(Op)) &&
+            L->isLoopInvariant(Op)) {
+          ValueScratch.insert(Op);
+        }
+      }
+    }
+  }
+
+  return ValueScratch.size();
+}
+
+unsigned LoopMetrics::getMaxLive(Loop *L) const {
+  unsigned MaxLive = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    // Walk the block backwards from the values it defines that are
+    // used by other blocks or phis, a value is live from its
+    // definition to its last use
+    ValueScratch.clear();
+    for (const Instruction &I : *BB) {
+      for (const User *U : I.users()) {
+        const auto *UI = cast<Instruction>(U);
+        if (UI->getParent() != BB || isa<PHINode>(UI)) {
+          ValueScratch.insert(&I);
+          break;
+        }
+      }
+    }
+
+    unsigned Live = ValueScratch.size();
+    MaxLive = std::max(MaxLive, Live);
+    for (const Instruction &I : reverse(*BB)) {
+      if (isa<PHINode>(I)) {
+        break;
+      }
+      if (ValueScratch.erase(&I)) {
+        Live--;
+      }
+      for (const Value *Op : I.operands()) {
+        const auto *OpI = dyn_cast<Instruction>(Op);
+        if (OpI && OpI->getParent() == BB && ValueScratch.insert(OpI).second) {
+          Live++;
+        }
+      }
+      MaxLive = std::max(MaxLive, Live);
+    }
+  }
+
+  return MaxLive;
+}
+
+stable_hash LoopMetrics::getFingerprint(Loop *L, const LoopInfo *LI) const {
+  // Number the blocks and instructions first since phis can use
+  // values defined later in the loop
+  unsigned Generation = ++FingerprintGeneration;
+  unsigned NumLocal = 0, NumExternal = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    LocalValues[BB] = {Generation, NumLocal++};
+    for (const Instruction &I : *BB) {
+      LocalValues[&I] = {Generation, NumLocal++};
+    }
+  }
+
+  stable_hash Hash = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    unsigned RelativeDepth = LI->getLoopDepth(BB) - L->getLoopDepth();
+    Hash = stable_hash_combine(Hash, BB->size(), RelativeDepth);
+
+    for (const Instruction &I : *BB) {
+      stable_hash Operands = 0;
+      unsigned First = 0;
+      if (I.isCommutative()) {
+        stable_hash LHS = hashOperand(I.getOperand(0), NumExternal);
+        stable_hash RHS = hashOperand(I.getOperand(1), NumExternal);
+        Operands = stable_hash_combine(std::min(LHS, RHS), std::max(LHS, RHS));
+        First = 2;
+      }
+      for (unsigned i = First, e = I.getNumOperands(); i < e; ++i) {
+        Operands = stable_hash_combine(
+            Operands, hashOperand(I.getOperand(i), NumExternal));
+      }
+
+      stable_hash Predicate = 0;
+      if (const auto *CI = dyn_cast<CmpInst>(&I)) {
+        Predicate = CI->getPredicate();
+      }
+
+      Hash = stable_hash_combine(
+          Hash, stable_hash_combine(I.getOpcode(), hashType(I.getType()),
+                                    Predicate, Operands));
+    }
+  }
+
+  return Hash;
+}
+
+stable_hash LoopMetrics::hashType(Type *Ty) const {
+  stable_hash Hash = Ty->getTypeID();
+  if (Ty->isIntegerTy()) {
+    Hash = stable_hash_combine(Hash, Ty->getIntegerBitWidth());
+  } else if (Ty->isPointerTy()) {
+    Hash = stable_hash_combine(Hash, Ty->getPointerAddressSpace());
+  } else if (auto *VTy = dyn_cast<VectorType>(Ty)) {
+    Hash = stable_hash_combine(Hash,
+                               VTy->getElementCount().getKnownMinValue(),
+                               hashType(VTy->getElementType()));
+  }
+
+  return Hash;
+}
+
+stable_hash LoopMetrics::hashOperand(const Value *V,
+                                    unsigned &NumExternal) const {
+  unsigned Generation = FingerprintGeneration;
+  auto It = LocalValues.find(V);
+  if (It != LocalValues.end() && It->second.first == Generation) {
+    return stable_hash_combine(1, It->second.second);
+  }
+
+  if (const auto *CI = dyn_cast<ConstantInt>(V)) {
+    if (CI->getBitWidth() <= 64) {
+      return stable_hash_combine(2, CI->getZExtValue(),
+                                 hashType(CI->getType()));
+    }
+  }
+
+  if (const auto *CFP = dyn_cast<ConstantFP>(V)) {
+    return stable_hash_combine(
+        3, CFP->getValueAPF().bitcastToAPInt().getLimitedValue(),
+        hashType(CFP->getType()));
+  }
+
+  // Loops calling different functions or using different globals do
+  // not share their metrics, so those are told apart by identity
+  if (const auto *F = dyn_cast<Function>(V)) {
+    if (Intrinsic::ID ID = F->getIntrinsicID()) {
+      // Overloads of an intrinsic differ in their types
+      stable_hash Hash =
+          stable_hash_combine(7, ID, hashType(F->getReturnType()));
+      for (Type *Param : F->getFunctionType()->params()) {
+        Hash = stable_hash_combine(Hash, hashType(Param));
+      }
+      return Hash;
+    }
+  }
+  if (const auto *GV = dyn_cast<GlobalValue>(V)) {
+    return stable_hash_combine(8, stable_hash_combine_string(GV->getName()),
+                               hashType(GV->getType()));
+  }
+
+  if (const auto *CE = dyn_cast<ConstantExpr>(V)) {
+    stable_hash Hash =
+        stable_hash_combine(9, CE->getOpcode(), hashType(CE->getType()));
+    for (const Value *Op : CE->operands()) {
+      Hash = stable_hash_combine(Hash, hashOperand(Op, NumExternal));
+    }
+    return Hash;
+  }
+
+  if (isa<Constant>(V)) {
+    return stable_hash_combine(4, V->getValueID(), hashType(V->getType()));
+  }
+
+  if (const auto *A = dyn_cast<Argument>(V)) {
+    return stable_hash_combine(5, A->getArgNo());
+  }
+
+  // Values defined before the loop and blocks outside of it
+  std::pair<unsigned, unsigned> &External = ExternalValues[V];
+  if (External.first != Generation) {
+    External = {Generation, NumExternal++};
+  }
+  return stable_hash_combine(6, External.second, hashType(V->getType()));
+}
+
+void LoopInfoNA::printDuplicates() const {
+  SmallVector<const FingerprintEntry *, 16> Duplicates;
+  for (const auto &Entry : Fingerprints) {
+    if (Entry.second.Count > 1) {
+      Duplicates.push_back(&Entry.second);
+    }
+  }
+
+  llvm::sort(Duplicates, [](const FingerprintEntry *A,
+                            const FingerprintEntry *B) {
+    if (A->Count != B->Count) {
+      return A->Count > B->Count;
+    }
+    return A->FirstID < B->FirstID;
+  });
+
+  errs() << "fingerprints: loops=" << this->numLoops
+         << ", unique=" << Fingerprints.size()
+         << ", duplicated=" << Duplicates.size() << '\n';
+  for (const FingerprintEntry *Entry : Duplicates) {
+    errs() << "  fingerprint=" << format_hex(Entry->Record.Fingerprint, 18)
+           << ", count=" << Entry->Count << ", first=" << Entry->FirstID
+           << ", func=" << Entry->FirstFunction << '\n';
+  }
+}
+
+void LoopInfoNA::startFunction(const Function &F) {
+  if (CurrentFunction) {
+    finishFunction();
+  }
+  CurrentFunction = &F;
+
+  // Size classes are powers of two of the instruction count
+  CurrentStratum =
+      SampleStratify ? Log2_32(std::max(1u, F.getInstructionCount())) : 0;
+  SampleStratum &Stratum = Strata[CurrentStratum];
+  Stratum.Functions++;
+
+  // Hashing the name makes the choice independent of the order and of
+  // the module the function is in. With stratification the first
+  // function of every size class is always taken so that none of them
+  // is left without an estimate.
+  stable_hash Hash = stable_hash_combine(
+      SampleSeed, stable_hash_combine_string(F.getName()));
+  double Uniform = static_cast<double>(Hash >> 11) / (uint64_t(1) << 53);
+  CurrentSampled = Uniform < SampleFraction ||
+                   (SampleStratify && Stratum.Functions == 1);
+
+  std::fill(std::begin(CurrentTotals), std::end(CurrentTotals), 0.0);
+}
+
+void LoopInfoNA::finishFunction() {
+  if (CurrentSampled) {
+    SampleStratum &Stratum = Strata[CurrentStratum];
+    Stratum.Sampled++;
+    for (size_t i = 0; i < array_lengthof(CurrentTotals); ++i) {
+      Stratum.Sum[i] += CurrentTotals[i];
+      Stratum.SumSquares[i] += CurrentTotals[i] * CurrentTotals[i];
+    }
+  }
+
+  CurrentFunction = nullptr;
+}
+
+void LoopInfoNA::printEstimates() const {
+  uint64_t Functions = 0, Sampled = 0;
+  for (const auto &Entry : Strata) {
+    Functions += Entry.second.Functions;
+    Sampled += Entry.second.Sampled;
+  }
+  errs() << "sample: functions=" << Functions << ", sampled=" << Sampled
+         << ", strata=" << Strata.size() << '\n';
+
+  for (size_t i = 0; i < array_lengthof(SummaryMetrics) + 1; ++i) {
+    // Every stratum total is estimated as its number of functions times
+    // the sample mean, the variance includes the finite population
+    // correction
+    // A stratum that is not fully sampled needs two sampled functions
+    // for its variance, otherwise the interval is unknown
+    double Total = 0, Variance = 0;
+    bool Bounded = true;
+    for (const auto &Entry : Strata) {
+      const SampleStratum &Stratum = Entry.second;
+      if (Stratum.Sampled < 2 && Stratum.Sampled < Stratum.Functions) {
+        Bounded = false;
+      }
+      if (Stratum.Sampled == 0) {
+        continue;
+      }
+
+      double N = Stratum.Functions, n = Stratum.Sampled;
+      double Mean = Stratum.Sum[i] / n;
+      Total += N * Mean;
+      if (n > 1) {
+        double S2 = (Stratum.SumSquares[i] - n * Mean * Mean) / (n - 1);
+        Variance += N * N * (1 - n / N) * std::max(0.0, S2) / n;
+      }
+    }
+
+    double Margin = 1.96 * std::sqrt(Variance);
+    const char *Name = i < array_lengthof(SummaryMetrics)
+                           ? SummaryMetrics[i].Name
+                           : "loops";
+    errs() << "estimate: metric=" << Name << ", total=" << format("%.0f", Total)
+           << ", ci95=";
+    if (Bounded) {
+      errs() << '[' << format("%.0f", std::max(0.0, Total - Margin)) << ", "
+             << format("%.0f", Total + Margin) << "]\n";
+    } else {
+      errs() << "unknown\n";
+    }
+  }
+}
+
+Histogram &LoopInfoNA::getSummary(StringRef Metric, int Depth) {
+  auto It = Summaries.find(std::make_pair(Metric, Depth));
+  if (It == Summaries.end()) {
+    It = Summaries.emplace(std::make_pair(Metric.str(), Depth), Histogram())
+             .first;
+  }
+  return It->second;
+}
+
+void LoopInfoNA::addToSummary(const LoopRecord &Record) {
+  for (const auto &Metric : SummaryMetrics) {
+    getSummary(Metric.Name, Record.Depth).add(Metric.Get(Record));
+  }
+  getSummary("IVs", Record.Depth).add(Record.IVWidths.size());
+}
+
+void LoopInfoNA::readSummary(StringRef Filename) {
+  auto Buffer = MemoryBuffer::getFile(Filename);
+  if (!Buffer) {
+    errs() << "LoopInfoNA: cannot read summary " << Filename << ": "
+           << Buffer.getError().message() << '\n';
+    return;
+  }
+
+  // Every line is "<metric> <depth> <histogram fields>"
+  for (line_iterator Line(**Buffer, true); !Line.is_at_end(); ++Line) {
+    StringRef Metric, DepthField, Fields;
+    std::tie(Metric, Fields) = Line->split(' ');
+    std::tie(DepthField, Fields) = Fields.split(' ');
+
+    int Depth;
+    Histogram H;
+    if (DepthField.getAsInteger(10, Depth) || !H.read(Fields)) {
+      errs() << "LoopInfoNA: malformed summary line in " << Filename
+             << ": " << *Line << '\n';
+      continue;
+    }
+    Summaries[{Metric.str(), Depth}].merge(H);
+  }
+}
+
+void LoopInfoNA::writeSummary(StringRef Filename) const {
+  std::error_code EC;
+  raw_fd_ostream OS(Filename, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "LoopInfoNA: cannot write summary " << Filename << ": "
+           << EC.message() << '\n';
+    return;
+  }
+
+  for (const auto &Entry : Summaries) {
+    OS << Entry.first.first << ' ' << Entry.first.second << ' ';
+    Entry.second.write(OS);
+    OS << '\n';
+  }
+}
+
+void LoopInfoNA::printSummary() const {
+  for (const auto &Entry : Summaries) {
+    const Histogram &H = Entry.second;
+    errs() << "summary: metric=" << Entry.first.first
+           << ", depth=" << Entry.first.second << ", loops=" << H.count()
+           << ", mean="
+           << format("%.2f", static_cast<double>(H.sum()) / H.count())
+           << ", min=" << H.min() << ", p50=" << H.quantile(0.5)
+           << ", p90=" << H.quantile(0.9) << ", p99=" << H.quantile(0.99)
+           << ", max=" << H.max() << '\n';
+  }
+}
+
+void Histogram::add(uint64_t Value, uint64_t Times) {
+  Buckets[getBucket(Value)] += Times;
+  Count += Times;
+  Sum += Value * Times;
+  Min = std::min(Min, Value);
+  Max = std::max(Max, Value);
+}
+
+void Histogram::merge(const Histogram &Other) {
+  for (const auto &Bucket : Other.Buckets) {
+    Buckets[Bucket.first] += Bucket.second;
+  }
+  Count += Other.Count;
+  Sum += Other.Sum;
+  Min = std::min(Min, Other.Min);
+  Max = std::max(Max, Other.Max);
+}
+
+uint64_t Histogram::quantile(double Q) const {
+  if (Count == 0) {
+    return 0;
+  }
+
+  // Rank of the wanted value, counting from 1
+  uint64_t Rank = std::max<uint64_t>(1, std::ceil(Q * Count));
+  uint64_t Seen = 0;
+  for (const auto &Bucket : Buckets) {
+    Seen += Bucket.second;
+    if (Seen >= Rank) {
+      uint64_t Lower = getLowerBound(Bucket.first);
+      uint64_t Upper = getUpperBound(Bucket.first);
+      uint64_t Middle = Lower + (Upper - Lower) / 2;
+      return std::min(std::max(Middle, Min), Max);
+    }
+  }
+
+  return Max;
+}
+
+void Histogram::write(raw_ostream &OS) const {
+  OS << Count << ' ' << Sum << ' ' << Min << ' ' << Max;
+  for (const auto &Bucket : Buckets) {
+    OS << ' ' << Bucket.first << ':' << Bucket.second;
+  }
+}
+
+bool Histogram::read(StringRef Fields) {
+  SmallVector<StringRef, 32> Parts;
+  Fields.split(Parts, ' ', -1, false);
+  if (Parts.size() < 4 || Parts[0].getAsInteger(10, Count) ||
+      Parts[1].getAsInteger(10, Sum) || Parts[2].getAsInteger(10, Min) ||
+      Parts[3].getAsInteger(10, Max)) {
+    return false;
+  }
+
+  for (StringRef Part : makeArrayRef(Parts).drop_front(4)) {
+    StringRef BucketField, CountField;
+    std::tie(BucketField, CountField) = Part.split(':');
+
+    unsigned Bucket;
+    uint64_t BucketCount;
+    if (BucketField.getAsInteger(10, Bucket) ||
+        CountField.getAsInteger(10, BucketCount)) {
+      return false;
+    }
+    Buckets[Bucket] += BucketCount;
+  }
+
+  return true;
+}
+
+unsigned Histogram::getBucket(uint64_t Value) {
+  if (Value < 32) {
+    return Value;
+  }
+
+  // Keep the 5 most significant bits, the leading one selects the
+  // power of two and the other 4 the bucket within it
+  unsigned Exponent = Log2_64(Value);
+  unsigned Shift = Exponent - 4;
+  return 32 + (Exponent - 5) * 16 + ((Value >> Shift) - 16);
+}
+
+uint64_t Histogram::getLowerBound(unsigned Bucket) {
+  if (Bucket < 32) {
+    return Bucket;
+  }
+
+  unsigned Exponent = (Bucket - 32) / 16 + 5;
+  uint64_t Mantissa = (Bucket - 32) % 16 + 16;
+  return Mantissa << (Exponent - 4);
+}
+
+uint64_t Histogram::getUpperBound(unsigned Bucket) {
+  if (Bucket < 32) {
+    return Bucket;
+  }
+
+  unsigned Exponent = (Bucket - 32) / 16 + 5;
+  return getLowerBound(Bucket) + (uint64_t(1) << (Exponent - 4)) - 1;
+}
+
+// Recursive descent parser of filter expressions:
+//   or      := and ('||' and)*
+//   and     := unary ('&&' unary)*
+//   unary   := '!' unary | '(' or ')' | field (op value)?
+//   value   := integer | true | false | "string"
+class LoopFilter::Parser {
+public:
+  Parser(StringRef Text, std::string &Error) : Text(Text), Error(Error) {}
+
+  std::unique_ptr<Node> parse() {
+    std::unique_ptr<Node> N = parseOr();
+    if (N && !atEnd()) {
+      return fail("unexpected '" + Text.take_front(1) + "'");
+    }
+    return N;
+  }
+
+private:
+  StringRef Text;
+  std::string &Error;
+
+  bool atEnd() {
+    Text = Text.ltrim();
+    return Text.empty();
+  }
+
+  // Consume Token if the remaining text starts with it
+  bool accept(StringRef Token) {
+    Text = Text.ltrim();
+    if (!Text.startswith(Token)) {
+      return false;
+    }
+    Text = Text.drop_front(Token.size());
+    return true;
+  }
+
+  std::unique_ptr<Node> fail(const Twine &Message) {
+    Error = Message.str();
+    return nullptr;
+  }
+
+  std::unique_ptr<Node> makeBinary(decltype(Node::Kind) Kind,
+                                   std::unique_ptr<Node> LHS,
+                                   std::unique_ptr<Node> RHS) {
+    auto N = std::make_unique<Node>();
+    N->Kind = Kind;
+    N->LHS = std::move(LHS);
+    N->RHS = std::move(RHS);
+    return N;
+  }
+
+  std::unique_ptr<Node> parseOr() {
+    std::unique_ptr<Node> LHS = parseAnd();
+    while (LHS && accept("||")) {
+      std::unique_ptr<Node> RHS = parseAnd();
+      if (!RHS) {
+        return nullptr;
+      }
+      LHS = makeBinary(Node::Or, std::move(LHS), std::move(RHS));
+    }
+    return LHS;
+  }
+
+  std::unique_ptr<Node> parseAnd() {
+    std::unique_ptr<Node> LHS = parseUnary();
+    while (LHS && accept("&&")) {
+      std::unique_ptr<Node> RHS = parseUnary();
+      if (!RHS) {
+        return nullptr;
+      }
+      LHS = makeBinary(Node::And, std::move(LHS), std::move(RHS));
+    }
+    return LHS;
+  }
+
+  std::unique_ptr<Node> parseUnary() {
+    if (accept("!")) {
+      std::unique_ptr<Node> Operand = parseUnary();
+      if (!Operand) {
+        return nullptr;
+      }
+      return makeBinary(Node::Not, std::move(Operand), nullptr);
+    }
+
+    if (accept("(")) {
+      std::unique_ptr<Node> N = parseOr();
+      if (N && !accept(")")) {
+        return fail("expected ')'");
+      }
+      return N;
+    }
+
+    return parseComparison();
+  }
+
+  std::unique_ptr<Node> parseComparison() {
+    Text = Text.ltrim();
+    StringRef Name = Text.take_while([](char C) { return isAlnum(C); });
+    Text = Text.drop_front(Name.size());
+
+    Optional<Field> F = StringSwitch<Optional<Field>>(Name)
+                            .Case("func", Field::Func)
+                            .Case("depth", Field::Depth)
+                            .Case("subLoops", Field::SubLoops)
+                            .Case("BBs", Field::BBs)
+                            .Case("instrs", Field::Instrs)
+                            .Case("atomics", Field::Atomics)
+                            .Case("branches", Field::Branches)
+                            .Case("IVs", Field::IVs)
+                            .Case("canonicalIV", Field::CanonicalIV)
+                            .Case("exiting", Field::Exiting)
+                            .Case("exits", Field::Exits)
+                            .Case("latchOnlyExit", Field::LatchOnlyExit)
+                            .Case("recMII", Field::RecMII)
+                            .Case("latencyBound", Field::LatencyBound)
+                            .Case("loads", Field::Loads)
+                            .Case("independentLoads", Field::IndependentLoads)
+                            .Case("loadChain", Field::LoadChain)
+                            .Case("vectorInstrs", Field::VectorInstrs)
+                            .Case("scalarInstrs", Field::ScalarInstrs)
+                            .Case("vectorBits", Field::VectorBits)
+                            .Case("maskedOps", Field::MaskedOps)
+                            .Case("gatherScatter", Field::GatherScatter)
+                            .Case("syncCalls", Field::SyncCalls)
+                            .Case("ioCalls", Field::IOCalls)
+                            .Case("samples", Field::Samples)
+                            .Default(None);
+    if (!F) {
+      return fail(Name.empty() ? "expected a field name"
+                               : "unknown field '" + Name + "'");
+    }
+
+    auto N = std::make_unique<Node>();
+    N->Kind = Node::Compare;
+    N->F = *F;
+
+    // Longer operators are tried first so that <= is not read as <
+    Optional<Op> O;
+    for (auto Candidate :
+         {std::make_pair("==", Op::EQ), std::make_pair("!=", Op::NE),
+          std::make_pair("<=", Op::LE), std::make_pair(">=", Op::GE),
+          std::make_pair("=~", Op::Match), std::make_pair("!~", Op::NoMatch),
+          std::make_pair("<", Op::LT), std::make_pair(">", Op::GT)}) {
+      if (accept(Candidate.first)) {
+        O = Candidate.second;
+        break;
+      }
+    }
+
+    // A boolean field on its own is true when the field is set
+    if (!O) {
+      if (N->F == Field::Func) {
+        return fail("expected an operator after 'func'");
+      }
+      N->O = Op::NE;
+      return N;
+    }
+    N->O = *O;
+
+    if (N->F == Field::Func) {
+      return parseString(std::move(N));
+    }
+    if (N->O == Op::Match || N->O == Op::NoMatch) {
+      return fail("'=~' and '!~' can only be applied to func");
+    }
+    return parseNumber(std::move(N));
+  }
+
+  std::unique_ptr<Node> parseString(std::unique_ptr<Node> N) {
+    if (N->O != Op::EQ && N->O != Op::NE && N->O != Op::Match &&
+        N->O != Op::NoMatch) {
+      return fail("func only supports ==, !=, =~ and !~");
+    }
+    if (!accept("\"")) {
+      return fail("expected a string after func");
+    }
+
+    size_t End = Text.find('"');
+    if (End == StringRef::npos) {
+      return fail("unterminated string");
+    }
+    N->String = Text.take_front(End).str();
+    Text = Text.drop_front(End + 1);
+
+    if (N->O == Op::Match || N->O == Op::NoMatch) {
+      N->Pattern = std::make_unique<Regex>(N->String);
+      std::string RegexError;
+      if (!N->Pattern->isValid(RegexError)) {
+        return fail("invalid regular expression '" + N->String +
+                    "': " + RegexError);
+      }
+    }
+    return N;
+  }
+
+  std::unique_ptr<Node> parseNumber(std::unique_ptr<Node> N) {
+    if (accept("true")) {
+      N->Number = 1;
+      return N;
+    }
+    if (accept("false")) {
+      N->Number = 0;
+      return N;
+    }
+
+    Text = Text.ltrim();
+    StringRef Digits = Text.take_while([](char C) { return isDigit(C); });
+    if (Digits.empty() || Digits.getAsInteger(10, N->Number)) {
+      return fail("expected a number");
+    }
+    Text = Text.drop_front(Digits.size());
+    return N;
+  }
+};
+
+std::unique_ptr<LoopFilter> LoopFilter::compile(StringRef Text,
+                                                std::string &Error) {
+  std::unique_ptr<Node> Root = Parser(Text, Error).parse();
+  if (!Root) {
+    return nullptr;
+  }
+
+  std::unique_ptr<LoopFilter> Result(new LoopFilter());
+  Result->Root = std::move(Root);
+  return Result;
+}
+
+FilterResult LoopFilter::evaluate(const LoopRecord &Record,
+                                  bool Partial) const {
+  return evaluate(*Root, Record, Partial);
+}
+
+FilterResult LoopFilter::evaluate(const Node &N, const LoopRecord &Record,
+                                  bool Partial) const {
+  switch (N.Kind) {
+  case Node::Not: {
+    FilterResult R = evaluate(*N.LHS, Record, Partial);
+    if (R == FilterResult::Unknown) {
+      return R;
+    }
+    return R == FilterResult::True ? FilterResult::False : FilterResult::True;
+  }
+  case Node::And: {
+    FilterResult L = evaluate(*N.LHS, Record, Partial);
+    if (L == FilterResult::False) {
+      return L;
+    }
+    FilterResult R = evaluate(*N.RHS, Record, Partial);
+    return R == FilterResult::True ? L : R;
+  }
+  case Node::Or: {
+    FilterResult L = evaluate(*N.LHS, Record, Partial);
+    if (L == FilterResult::True) {
+      return L;
+    }
+    FilterResult R = evaluate(*N.RHS, Record, Partial);
+    return R == FilterResult::False ? L : R;
+  }
+  case Node::Compare:
+    break;
+  }
+
+  bool Result;
+  if (N.F == Field::Func) {
+    if (N.Pattern) {
+      Result = N.Pattern->match(Record.Function) == (N.O == Op::Match);
+    } else {
+      Result = (Record.Function == N.String) == (N.O == Op::EQ);
+    }
+  } else {
+    if (Partial && N.F != Field::Depth) {
+      return FilterResult::Unknown;
+    }
+
+    int64_t Value = getNumber(Record, N.F);
+    switch (N.O) {
+    case Op::EQ:
+      Result = Value == N.Number;
+      break;
+    case Op::NE:
+      Result = Value != N.Number;
+      break;
+    case Op::LT:
+      Result = Value < N.Number;
+      break;
+    case Op::LE:
+      Result = Value <= N.Number;
+      break;
+    case Op::GT:
+      Result = Value > N.Number;
+      break;
+    case Op::GE:
+      Result = Value >= N.Number;
+      break;
+    default:
+      llvm_unreachable("regular expressions only apply to func");
+    }
+  }
+
+  return Result ? FilterResult::True : FilterResult::False;
+}
+
+int64_t LoopFilter::getNumber(const LoopRecord &Record, Field F) {
+  switch (F) {
+  case Field::Func:
+    break;
+  case Field::Depth:
+    return Record.Depth;
+  case Field::SubLoops:
+    return Record.SubLoops;
+  case Field::BBs:
+    return Record.Blocks;
+  case Field::Instrs:
+    return Record.Instructions;
+  case Field::Atomics:
+    return Record.Atomics;
+  case Field::Branches:
+    return Record.Branches;
+  case Field::IVs:
+    return Record.IVWidths.size();
+  case Field::CanonicalIV:
+    return Record.CanonicalIV;
+  case Field::Exiting:
+    return Record.ExitingBlocks;
+  case Field::Exits:
+    return Record.ExitBlocks;
+  case Field::LatchOnlyExit:
+    return Record.LatchOnlyExit;
+  case Field::RecMII:
+    return Record.RecMII;
+  case Field::LatencyBound:
+    return Record.LatencyBound;
+  case Field::Loads:
+    return Record.Loads;
+  case Field::IndependentLoads:
+    return Record.IndependentLoads;
+  case Field::LoadChain:
+    return Record.LoadChain;
+  case Field::VectorInstrs:
+    return Record.VectorInstructions;
+  case Field::ScalarInstrs:
+    return Record.ScalarInstructions;
+  case Field::VectorBits:
+    // The widest vector width used, 0 for scalar loops
+    for (unsigned i = LoopRecord::NumVectorWidths; i > 0; --i) {
+      if (Record.VectorWidths[i - 1]) {
+        return 64 << (i - 1);
+      }
+    }
+    return 0;
+  case Field::MaskedOps:
+    return Record.MaskedOps;
+  case Field::GatherScatter:
+    return Record.GatherScatter;
+  case Field::SyncCalls:
+    return Record.SyncCalls;
+  case Field::IOCalls:
+    return Record.IOCalls;
+  case Field::Samples:
+    return Record.Samples;
+  }
+
+  llvm_unreachable("func is not a number");
+}
+
+// Check if a line is a sample profile function header,
+// function:total:head with the function name possibly containing ':'
+static bool isSampleProfileHeader(StringRef Line, StringRef &Function,
+                                  uint64_t &Total) {
+  if (Line.empty() || isSpace(Line.front())) {
+    return false;
+  }
+
+  StringRef Rest, Head, TotalField;
+  std::tie(Rest, Head) = Line.rtrim().rsplit(':');
+  std::tie(Function, TotalField) = Rest.rsplit(':');
+  uint64_t HeadSamples;
+  return !Function.empty() && !TotalField.getAsInteger(10, Total) &&
+         !Head.getAsInteger(10, HeadSamples);
+}
+
+bool LoopProfile::load(StringRef Filename, std::string &Error) {
+  auto Buffer = MemoryBuffer::getFile(Filename);
+  if (!Buffer) {
+    Error = Buffer.getError().message();
+    return false;
+  }
+
+  line_iterator First(**Buffer, true);
+  StringRef Function;
+  uint64_t FunctionTotal;
+  IsSampleProfile = !First.is_at_end() &&
+                    isSampleProfileHeader(*First, Function, FunctionTotal);
+
+  if (IsSampleProfile) {
+    return loadSampleProfile(**Buffer, Error);
+  }
+  return loadPerfScript(**Buffer, Error);
+}
+
+bool LoopProfile::loadPerfScript(const MemoryBuffer &Buffer,
+                                 std::string &Error) {
+  SmallVector<StringRef, 16> Tokens;
+  for (line_iterator Line(Buffer, true); !Line.is_at_end(); ++Line) {
+    Tokens.clear();
+    Line->split(Tokens, ' ', -1, false);
+
+    // The source line is the last file:line token, timestamps and
+    // event names end with ':' and are skipped by requiring a number
+    for (StringRef Token : llvm::reverse(Tokens)) {
+      StringRef File, LineField;
+      std::tie(File, LineField) = Token.trim().rsplit(':');
+      unsigned LineNumber;
+      if (File.empty() || LineField.getAsInteger(10, LineNumber) ||
+          LineNumber == 0) {
+        continue;
+      }
+
+      LineSamples[{sys::path::filename(File).str(), LineNumber}]++;
+      Total++;
+      break;
+    }
+  }
+
+  if (Total == 0) {
+    Error = "no source lines found, use perf script -F ip,srcline";
+    return false;
+  }
+  return true;
+}
+
+bool LoopProfile::loadSampleProfile(const MemoryBuffer &Buffer,
+                                    std::string &Error) {
+  // Samples of the function whose body is being read
+  std::map<std::pair<unsigned, unsigned>, uint64_t> *Current = nullptr;
+  // Indentation of the function body, deeper lines belong to inlined
+  // callees whose samples are already in their call site total
+  size_t BodyIndent = 0;
+
+  for (line_iterator Line(Buffer, true); !Line.is_at_end(); ++Line) {
+    StringRef Function;
+    uint64_t FunctionTotal;
+    if (isSampleProfileHeader(*Line, Function, FunctionTotal)) {
+      Current = &OffsetSamples[Function];
+      BodyIndent = 0;
+      Total += FunctionTotal;
+      continue;
+    }
+
+    StringRef Body = Line->ltrim();
+    size_t Indent = Line->size() - Body.size();
+    if (!Current || Body.startswith("!")) {
+      continue;
+    }
+    if (BodyIndent == 0) {
+      BodyIndent = Indent;
+    }
+    if (Indent != BodyIndent) {
+      continue;
+    }
+
+    // offset[.discriminator]: samples [calls] or, for an inlined call
+    // site, offset[.discriminator]: callee:total
+    StringRef Location, Rest;
+    std::tie(Location, Rest) = Body.split(": ");
+    StringRef OffsetField, DiscriminatorField;
+    std::tie(OffsetField, DiscriminatorField) = Location.split('.');
+    unsigned Offset, Discriminator = 0;
+    if (OffsetField.getAsInteger(10, Offset) ||
+        (!DiscriminatorField.empty() &&
+         DiscriminatorField.getAsInteger(10, Discriminator))) {
+      Error = ("malformed line: " + *Line).str();
+      return false;
+    }
+
+    StringRef Count = Rest.split(' ').first;
+    if (Count.contains(':')) {
+      Count = Count.rsplit(':').second;
+    }
+    uint64_t LineSamples;
+    if (Count.getAsInteger(10, LineSamples)) {
+      Error = ("malformed line: " + *Line).str();
+      return false;
+    }
+    (*Current)[{Offset, Discriminator}] += LineSamples;
+  }
+
+  return true;
+}
+
+uint64_t LoopProfile::getSamples(Loop *L) const {
+  const Function *F = L->getHeader()->getParent();
+  const DISubprogram *SP = F->getSubprogram();
+  const std::map<std::pair<unsigned, unsigned>, uint64_t> *Offsets =
+      nullptr;
+  if (IsSampleProfile) {
+    auto It = OffsetSamples.find(F->getName());
+    if (It == OffsetSamples.end() || !SP) {
+      return 0;
+    }
+    Offsets = &It->second;
+  }
+
+  // Lines are only counted once however many instructions they have
+  std::set<std::pair<std::string, unsigned>> Lines;
+  std::set<std::pair<unsigned, unsigned>> Seen;
+  uint64_t Count = 0;
+  for (const BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      const DILocation *Loc = I.getDebugLoc();
+      if (!Loc) {
+        continue;
+      }
+
+      if (!IsSampleProfile) {
+        // perf reports the innermost inlined location
+        auto Key = std::make_pair(sys::path::filename(Loc->getFilename()).str(),
+                                  Loc->getLine());
+        auto It = LineSamples.find(Key);
+        if (It != LineSamples.end() && Lines.insert(Key).second) {
+          Count += It->second;
+        }
+        continue;
+      }
+
+      // Sample profiles use the location of the outermost call site
+      while (const DILocation *InlinedAt = Loc->getInlinedAt()) {
+        Loc = InlinedAt;
+      }
+      if (Loc->getLine() < SP->getLine()) {
+        continue;
+      }
+      auto Key = std::make_pair(Loc->getLine() - SP->getLine(),
+                                Loc->getBaseDiscriminator());
+      auto It = Offsets->find(Key);
+      if (It != Offsets->end() && Seen.insert(Key).second) {
+        Count += It->second;
+      }
+    }
+  }
+
+  return Count;
+}
+
+// Write text escaped for HTML
+static void writeHTML(raw_ostream &OS, StringRef Text) {
+  for (char C : Text) {
+    switch (C) {
+    case '&':
+      OS << "&amp;";
+      break;
+    case '<':
+      OS << "&lt;";
+      break;
+    case '>':
+      OS << "&gt;";
+      break;
+    case '"':
+      OS << "&quot;";
+      break;
+    default:
+      OS << C;
+    }
+  }
+}
+
+// Write text as a JavaScript string literal that can be put inside a
+// script element
+static void writeJSString(raw_ostream &OS, StringRef Text) {
+  OS << '"';
+  for (unsigned char C : Text) {
+    if (C == '"' || C == '\\') {
+      OS << '\\' << C;
+    } else if (C < 0x20 || C == '<') {
+      OS << format("\\u%04x", C);
+    } else {
+      OS << C;
+    }
+  }
+  OS << '"';
+}
+
+// Columns of the loop table, in the order of the row arrays
+static const char *const HTMLColumns[] = {
+    "id",     "func",    "depth",   "subLoops", "BBs",     "instrs",
+    "atomics", "branches", "IVs",   "exits",    "samples", "hoisted",
+    "duplicateOf"};
+
+static const char HTMLHeader[] = R"HTML(<!DOCTYPE html>
+<html>
+<head>
+<meta charset="utf-8">
+<title>LoopInfoNA report</title>
+<style>
+body { font-family: sans-serif; margin: 1em 2em; }
+table { border-collapse: collapse; font-size: 90%; }
+th, td { border: 1px solid #ccc; padding: 2px 6px; text-align: right; }
+th { background: #eee; cursor: pointer; position: sticky; top: 0; }
+td:nth-child(2) { text-align: left; font-family: monospace; }
+details { margin-left: 1em; }
+summary { cursor: pointer; font-family: monospace; }
+pre { background: #f6f6f6; margin: 2px 0 2px 1em; padding: 4px; }
+ul { list-style: none; padding-left: 1em; }
+.hoisted { color: #060; font-family: monospace; }
+</style>
+<script>
+var R = [], S = 0, D = 1, P = 0, N = 200;
+function esc(v) {
+  return String(v).replace(/&/g, "&amp;").replace(/</g, "&lt;");
+}
+function render() {
+  var h = "";
+  for (var i = P * N; i < Math.min(R.length, (P + 1) * N); i++) {
+    h += "<tr>";
+    for (var j = 0; j < R[i].length; j++)
+      h += "<td>" + esc(R[i][j] === -1 ? "" : R[i][j]) + "</td>";
+    h += "</tr>";
+  }
+  document.getElementById("rows").innerHTML = h;
+  document.getElementById("page").textContent = "loops " +
+    Math.min(R.length, P * N + 1) + "-" + Math.min(R.length, (P + 1) * N) +
+    " of " + R.length;
+}
+function sortBy(j) {
+  D = S == j ? -D : 1;
+  S = j;
+  R.sort(function(a, b) { return a[j] < b[j] ? -D : a[j] > b[j] ? D : 0; });
+  P = 0;
+  render();
+}
+function page(d) {
+  P = Math.max(0, Math.min(P + d, Math.floor((R.length - 1) / N)));
+  render();
+}
+</script>
+</head>
+<body>
+<h1>LoopInfoNA report</h1>
+<h2>Loops</h2>
+<p><button onclick="page(-1)">&lt;</button>
+<span id="page"></span>
+<button onclick="page(1)">&gt;</button></p>
+)HTML";
+
+bool HTMLReport::open(StringRef Filename, std::string &Error) {
+  std::error_code EC;
+  OS = std::make_unique<raw_fd_ostream>(Filename, EC, sys::fs::OF_Text);
+  if (EC) {
+    Error = EC.message();
+    return false;
+  }
+
+  *OS << HTMLHeader << "<table>\n<thead><tr>";
+  for (size_t i = 0; i < array_lengthof(HTMLColumns); ++i) {
+    *OS << "<th onclick=\"sortBy(" << i << ")\">" << HTMLColumns[i]
+        << "</th>";
+  }
+  *OS << "</tr></thead>\n<tbody id=\"rows\"></tbody>\n</table>\n"
+      << "<h2>Loop nests</h2>\n";
+
+  return true;
+}
+
+bool HTMLReport::loadRemarks(StringRef Filename, std::string &Error) {
+  auto Buffer = MemoryBuffer::getFile(Filename);
+  if (!Buffer) {
+    Error = Buffer.getError().message();
+    return false;
+  }
+
+  auto Parser = remarks::createRemarkParserFromMeta(remarks::Format::YAML,
+                                                    (*Buffer)->getBuffer());
+  if (!Parser) {
+    Error = toString(Parser.takeError());
+    return false;
+  }
+
+  while (true) {
+    Expected<std::unique_ptr<remarks::Remark>> Remark = (*Parser)->next();
+    if (!Remark) {
+      llvm::Error E = Remark.takeError();
+      if (E.isA<remarks::EndOfFileError>()) {
+        consumeError(std::move(E));
+        return true;
+      }
+      Error = toString(std::move(E));
+      return false;
+    }
+
+    const remarks::Remark &R = **Remark;
+    if (R.PassName != "LICMNA" || R.RemarkName != "Hoisted") {
+      continue;
+    }
+
+    StringRef Header, Inst;
+    for (const remarks::Argument &Arg : R.Args) {
+      if (Arg.Key == "Header") {
+        Header = Arg.Val;
+      } else if (Arg.Key == "Inst") {
+        Inst = Arg.Val;
+      }
+    }
+    Remarks[{R.FunctionName.str(), Header.str()}].push_back(Inst.str());
+  }
+}
+
+void HTMLReport::addLoop(int ID, const LoopRecord &Record, Loop *L) {
+  StringRef FunctionName = L->getHeader()->getParent()->getName();
+  if (FunctionName != Function) {
+    finishFunction();
+    Function = FunctionName.str();
+  }
+
+  auto It = Remarks.find({Function, L->getHeader()->getName().str()});
+  size_t NumHoisted = It == Remarks.end() ? 0 : It->second.size();
+
+  raw_string_ostream Row(Rows);
+  Row << (NumRows++ ? "," : "") << '[' << ID << ',';
+  writeJSString(Row, Record.Function);
+  Row << ',' << Record.Depth << ',' << Record.SubLoops << ','
+      << Record.Blocks << ',' << Record.Instructions << ',' << Record.Atomics
+      << ',' << Record.Branches << ',' << Record.IVWidths.size() << ','
+      << Record.ExitBlocks << ',' << Record.Samples << ',' << NumHoisted
+      << ',' << Record.DuplicateOf << "]\n";
+  Row.flush();
+  if (NumRows == 256) {
+    flushRows();
+  }
+
+  Node N;
+  N.ID = ID;
+  N.L = L;
+  N.Parent = L->getParentLoop();
+  raw_string_ostream Summary(N.Summary);
+  Summary << '#' << ID << " header=" << L->getHeader()->getName()
+          << " depth=" << Record.Depth << " BBs=" << Record.Blocks
+          << " instrs=" << Record.Instructions
+          << " atomics=" << Record.Atomics << " samples=" << Record.Samples
+          << " hoisted=" << NumHoisted;
+  Summary.flush();
+  N.Snippet = getSnippet(L);
+  if (It != Remarks.end()) {
+    N.Hoisted = It->second;
+  }
+  Nodes.push_back(std::move(N));
+}
+
+void HTMLReport::finishFunction() {
+  if (Nodes.empty()) {
+    return;
+  }
+
+  DenseMap<const Loop *, size_t> Index;
+  for (size_t i = 0; i < Nodes.size(); ++i) {
+    Index[Nodes[i].L] = i;
+  }
+
+  *OS << "<details><summary>";
+  writeHTML(*OS, Function);
+  *OS << " (" << Nodes.size() << " loops)</summary>\n<ul>\n";
+  // Loops whose parent was not reported are shown at the top level
+  for (const Node &N : llvm::reverse(Nodes)) {
+    if (!Index.count(N.Parent)) {
+      writeNode(N, Index);
+    }
+  }
+  *OS << "</ul>\n</details>\n";
+
+  Nodes.clear();
+}
+
+void HTMLReport::writeNode(const Node &N,
+                           const DenseMap<const Loop *, size_t> &Index) {
+  *OS << "<li><details><summary>";
+  writeHTML(*OS, N.Summary);
+  *OS << "</summary>\n";
+
+  if (!N.Snippet.empty()) {
+    *OS << "<pre>";
+    writeHTML(*OS, N.Snippet);
+    *OS << "</pre>\n";
+  }
+
+  if (!N.Hoisted.empty()) {
+    *OS << "<ul class=\"hoisted\">";
+    for (const std::string &Inst : N.Hoisted) {
+      *OS << "<li>hoisted: ";
+      writeHTML(*OS, Inst);
+      *OS << "</li>";
+    }
+    *OS << "</ul>\n";
+  }
+
+  *OS << "<ul>\n";
+  for (const Loop *SL : N.L->getSubLoops()) {
+    auto It = Index.find(SL);
+    if (It != Index.end()) {
+      writeNode(Nodes[It->second], Index);
+    }
+  }
+  *OS << "</ul></details></li>\n";
+}
+
+void HTMLReport::flushRows() {
+  if (NumRows == 0) {
+    return;
+  }
+
+  *OS << "<script>R.push(" << Rows << ");</script>\n";
+  Rows.clear();
+  NumRows = 0;
+}
+
+void HTMLReport::close() {
+  finishFunction();
+  flushRows();
+  *OS << "<script>render();</script>\n</body>\n</html>\n";
+  OS->close();
+}
+
+std::string HTMLReport::getSnippet(Loop *L) {
+  // Lines of the loop in the file of its header, leaving out the code
+  // inlined from elsewhere
+  const DILocation *HeaderLoc = nullptr;
+  for (const Instruction &I : *L->getHeader()) {
+    const DILocation *Loc = I.getDebugLoc();
+    if (Loc && !Loc->getInlinedAt() && Loc->getLine() != 0) {
+      HeaderLoc = Loc;
+      break;
+    }
+  }
+  if (!HeaderLoc) {
+    return "";
+  }
+
+  unsigned First = HeaderLoc->getLine(), Last = HeaderLoc->getLine();
+  for (const BasicBlock *BB : L->blocks()) {
+    for (const Instruction &I : *BB) {
+      const DILocation *Loc = I.getDebugLoc();
+      if (Loc && !Loc->getInlinedAt() && Loc->getLine() != 0 &&
+          Loc->getFile() == HeaderLoc->getFile()) {
+        First = std::min(First, Loc->getLine());
+        Last = std::max(Last, Loc->getLine());
+      }
+    }
+  }
+  Last = std::min(Last, First + 24);
+
+  SmallString<128> Path(HeaderLoc->getFilename());
+  if (!sys::path::is_absolute(Path)) {
+    Path = HeaderLoc->getDirectory();
+    sys::path::append(Path, HeaderLoc->getFilename());
+  }
+
+  auto Inserted = Sources.try_emplace(Path);
+  if (Inserted.second) {
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (Buffer) {
+      auto File = std::make_unique<SourceFile>();
+      File->Buffer = std::move(*Buffer);
+      for (line_iterator Line(*File->Buffer, false); !Line.is_at_end();
+           ++Line) {
+        File->Lines.push_back(*Line);
+      }
+      Inserted.first->second = std::move(File);
+    }
+  }
+
+  const SourceFile *File = Inserted.first->second.get();
+  if (!File || First > File->Lines.size()) {
+    return "";
+  }
+
+  std::string Snippet;
+  raw_string_ostream Out(Snippet);
+  for (unsigned Line = First; Line <= Last && Line <= File->Lines.size();
+       ++Line) {
+    Out << format("%5u  ", Line) << File->Lines[Line - 1] << '\n';
+  }
+  return Out.str();
+}
+
+AnalysisKey LoopStatsAnalysis::Key;
+
+LoopStatsAnalysis::Result
+LoopStatsAnalysis::run(Loop &L, LoopAnalysisManager &AM,
+                       LoopStandardAnalysisResults &AR) {
+  Result Stats(InnerChanges);
+  Stats.compute(L, AM, AR);
+  return Stats;
+}
+
+void LoopStatsAnalysis::Result::compute(Loop &L, LoopAnalysisManager &AM,
+                                        LoopStandardAnalysisResults &AR) {
+  TimeTraceScope TimeScope("LoopInfoNA", [&] {
+    return (L.getHeader()->getParent()->getName() + ":" + L.getName())
+        .str();
+  });
+
+  // A change of a nested loop is only seen through its own result, so
+  // those are kept around for as long as this one
+  for (Loop *SubLoop : L) {
+    AM.getResult<LoopStatsAnalysis>(*SubLoop, AR);
+  }
+
+  LoopMetrics Metrics;
+  BumpPtrAllocator Allocator;
+
+  Record = LoopRecord();
+  Metrics.analyse(&L, &AR.SE, &AR.TTI, Allocator, Record);
+  Metrics.getBlockingCalls(&L, &AR.TLI, Record);
+  Metrics.getLocation(&L, Record);
+  IVWidths.assign(Record.IVWidths.begin(), Record.IVWidths.end());
+  Record.IVWidths = {};
+  Record.Fingerprint = Metrics.getFingerprint(&L, &AR.LI);
+  Changes = InnerChanges->lookup(&L);
+}
+
+const LoopRecord &
+LoopStatsAnalysis::Result::getRecord(Loop &L, LoopAnalysisManager &AM,
+                                     LoopStandardAnalysisResults &AR) {
+  if (InnerChanges->lookup(&L) != Changes) {
+    compute(L, AM, AR);
+  }
+  Record.IVWidths = IVWidths;
+  return Record;
+}
+
+bool LoopStatsAnalysis::Result::invalidate(
+    Loop &L, const PreservedAnalyses &PA,
+    LoopAnalysisManager::Invalidator &Inv) {
+  auto PAC = PA.getChecker<LoopStatsAnalysis>();
+  if (PAC.preserved() || PAC.preservedSet<AllAnalysesOn<Loop>>()) {
+    return false;
+  }
+
+  // Whatever changed L, e.g. hoisting into its preheader, may have
+  // changed the loops around it as well
+  for (Loop *Parent = L.getParentLoop(); Parent;
+       Parent = Parent->getParentLoop()) {
+    ++(*InnerChanges)[Parent];
+  }
+  return true;
+}
+
+PreservedAnalyses LoopInfoNAPrinterPass::run(Loop &L,
+                                             LoopAnalysisManager &AM,
+                                             LoopStandardAnalysisResults &AR,
+                                             LPMUpdater &U) {
+  LoopStatsAnalysis::Result &Stats = AM.getResult<LoopStatsAnalysis>(L, AR);
+  printRecord(errs(), NumLoops++, Stats.getRecord(L, AM, AR), nullptr);
+
+  return PreservedAnalyses::all();
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "LoopInfoNA", LLVM_VERSION_STRING,
+          [](PassBuilder &PB) {
+            PB.registerAnalysisRegistrationCallback(
+                [](LoopAnalysisManager &LAM) {
+                  LAM.registerPass([] { return LoopStatsAnalysis(); });
+                });
+            PB.registerPipelineParsingCallback(
+                [](StringRef Name, LoopPassManager &LPM,
+                   ArrayRef<PassBuilder::PipelineElement>) {
+                  if (Name == "print<loopinfona>") {
+                    LPM.addPass(LoopInfoNAPrinterPass());
+                    return true;
+                  }
+                  return false;
+                });
+          }};
+}
@@ -0,0 +1,95 @@
+#ifndef LOOPINFONA_H
+#define LOOPINFONA_H
+
+#include <functional>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/CodeGen/StableHashing.h"
+
+namespace llvm {
+class Pass;
+} // end of namespace llvm
+
+// All the information gathered for a single loop
+struct LoopRecord {
+  llvm::StringRef Function;
+  int Depth = 0;
+  bool SubLoops = false;
+  int Blocks = 0;
+  int Instructions = 0;
+  int Atomics = 0;
+  int Branches = 0;
+
+  // Bit widths of the SCEV add-recurrence phis in the loop header,
+  // the size of this array is the number of induction variables
+  llvm::ArrayRef<unsigned> IVWidths;
+  bool CanonicalIV = false;
+  int ExitingBlocks = 0;
+  int ExitBlocks = 0;
+  bool LatchOnlyExit = false;
+
+  // Latency in cycles of the longest recurrence of an innermost loop,
+  // a chain of instructions from a header phi back to it, 0 for other
+  // loops
+  int RecMII = 0;
+  // Whether a recurrence other than an induction variable takes longer
+  // than issuing the loop body, so that the loop is bound by its
+  // latency, e.g. a reduction that would gain from more accumulators
+  bool LatencyBound = false;
+
+  // Loads of the loop outside its subloops, those of them whose address
+  // does not depend on another load of the same iteration or on one of
+  // the previous iteration carried by a header phi, and the number of
+  // loads on the longest chain of loads each computing the address of
+  // the next. Pointer chasing loops have few independent loads and
+  // issue one miss at a time.
+  int Loads = 0;
+  int IndependentLoads = 0;
+  int LoadChain = 0;
+
+  // Arithmetic and memory instructions on vector and on scalar types,
+  // including those of the subloops, the vector ones by their width in
+  // bits: 64 or less, 128, 256, 512, and 1024 or more, and the masked
+  // loads and stores, of which the gathers and scatters
+  static constexpr unsigned NumVectorWidths = 5;
+  int VectorInstructions = 0;
+  int ScalarInstructions = 0;
+  int VectorWidths[NumVectorWidths] = {};
+  int MaskedOps = 0;
+  int GatherScatter = 0;
+
+  // Calls in the loop, including its subloops, that may block the
+  // thread: locks, waits and sleeps, and I/O
+  int SyncCalls = 0;
+  int IOCalls = 0;
+  // Source location of the loop, an empty file when it has no debug
+  // info
+  llvm::StringRef File;
+  unsigned Line = 0;
+
+  // Measured samples on the source lines of the loop, including the
+  // ones of its subloops
+  uint64_t Samples = 0;
+
+  // Unroll count recommended with -loopinfona-unroll-hints, 0 when
+  // there is none
+  int UnrollCount = 0;
+
+  // Structural hash of the loop body, independent of value names
+  llvm::stable_hash Fingerprint = 0;
+  // ID of the first loop with the same fingerprint, -1 if unique
+  int DuplicateOf = -1;
+};
+
+// Receives the ID, record and printed line of every reported loop.
+// The record lives in memory of the pass that is reused once the
+// function is done, so IVWidths must be copied to be kept.
+using LoopRecordSink =
+    std::function<void(int ID, const LoopRecord &Record, llvm::StringRef Line)>;
+
+// Create a LoopInfoNA pass that hands the loops it reports to Sink
+// instead of printing them, used to run the analysis from other tools
+llvm::Pass *createLoopInfoNAPass(LoopRecordSink Sink);
+
+#endif // LOOPINFONA_H
@@ -0,0 +1,187 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+#include "LoopInfoNA.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<module>"));
+
+static cl::opt<unsigned> Repeat("repeat", cl::init(10),
+                                cl::desc("Number of times the module is "
+                                         "analysed"));
+
+// Every heap allocation goes through these glibc entry points, also the
+// ones of operator new and of LLVM's own containers
+extern "C" void *__libc_malloc(size_t Size);
+extern "C" void *__libc_calloc(size_t Count, size_t Size);
+extern "C" void *__libc_realloc(void *Ptr, size_t Size);
+extern "C" void *__libc_memalign(size_t Alignment, size_t Size);
+
+static std::atomic<uint64_t> Allocations(0);
+
+extern "C" void *malloc(size_t Size) {
+  ++Allocations;
+  return __libc_malloc(Size);
+}
+
+extern "C" void *calloc(size_t Count, size_t Size) {
+  ++Allocations;
+  return __libc_calloc(Count, Size);
+}
+
+extern "C" void *realloc(void *Ptr, size_t Size) {
+  ++Allocations;
+  return __libc_realloc(Ptr, Size);
+}
+
+extern "C" void *aligned_alloc(size_t Alignment, size_t Size) {
+  ++Allocations;
+  return __libc_memalign(Alignment, Size);
+}
+
+extern "C" int posix_memalign(void **Ptr, size_t Alignment, size_t Size) {
+  ++Allocations;
+  *Ptr = __libc_memalign(Alignment, Size);
+  return *Ptr ? 0 : ENOMEM;
+}
+
+namespace {
+// Loop pass that only requires what LoopInfoNA requires and makes the
+// same scalar evolution and target queries, running it gives the
+// allocations made by the pass managers and the analyses. The latency
+// of every instruction of an innermost loop is queried, a superset of
+// those on the recurrences LoopInfoNA follows.
+class BaselineLoopPass : public LoopPass {
+public:
+  static char ID;
+
+  explicit BaselineLoopPass(bool TripCounts)
+      : LoopPass(ID), TripCounts(TripCounts) {}
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.setPreservesAll();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
+    AU.addRequired<TargetTransformInfoWrapperPass>();
+    AU.addRequired<TargetLibraryInfoWrapperPass>();
+  }
+
+  bool runOnLoop(Loop *L, LPPassManager &LPM) override {
+    ScalarEvolution &SE = getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+    const TargetTransformInfo &TTI =
+        getAnalysis<TargetTransformInfoWrapperPass>().getTTI(
+            *L->getHeader()->getParent());
+    getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(
+        *L->getHeader()->getParent());
+    for (PHINode &PN : L->getHeader()->phis()) {
+      if (SE.isSCEVable(PN.getType())) {
+        SE.getSCEV(&PN);
+        SE.getTypeSizeInBits(PN.getType());
+      }
+    }
+
+    if (L->isInnermost()) {
+      for (BasicBlock *BB : L->blocks()) {
+        for (Instruction &I : *BB) {
+          TTI.getInstructionCost(&I, TargetTransformInfo::TCK_Latency);
+        }
+      }
+      if (TripCounts) {
+        SE.getSmallConstantTripCount(L);
+        SE.getSmallConstantMaxTripCount(L);
+      }
+    }
+
+    return false;
+  }
+
+private:
+  // Query the trip counts as well, as LoopInfoNA does for its unroll
+  // hints
+  bool TripCounts;
+};
+} // end of anonymous namespace
+
+char BaselineLoopPass::ID = 0;
+
+// Run a pass manager over the module and get the number of allocations
+// made
+static uint64_t countAllocations(Module &M, legacy::PassManager &PM) {
+  uint64_t Before = Allocations;
+  PM.run(M);
+  return Allocations - Before;
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "Counts the heap allocations LoopInfoNA makes per loop on top of "
+      "the ones of the analyses it uses\n");
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+
+  LLVMContext Context;
+  SMDiagnostic Diagnostic;
+  std::unique_ptr<Module> M = parseIRFile(InputFilename, Diagnostic, Context);
+  if (!M) {
+    Diagnostic.print(argv[0], errs());
+    return 1;
+  }
+
+  uint64_t Loops = 0;
+  legacy::PassManager BaselinePM, AnalysisPM;
+  // The option lives with the pass, only its value is needed here
+  auto *UnrollHints = static_cast<cl::opt<bool> *>(
+      cl::getRegisteredOptions().lookup("loopinfona-unroll-hints"));
+  BaselinePM.add(new BaselineLoopPass(UnrollHints && *UnrollHints));
+  AnalysisPM.add(createLoopInfoNAPass(
+      [&Loops](int, const LoopRecord &, StringRef) { ++Loops; }));
+
+  // The first run grows the allocators and scratch space of the pass
+  // instance to the largest function and loop, which the later runs
+  // reuse, so it is reported on its own
+  int64_t FirstRun = static_cast<int64_t>(countAllocations(*M, AnalysisPM)) -
+                     static_cast<int64_t>(countAllocations(*M, BaselinePM));
+
+  uint64_t Baseline = 0, Analysis = 0;
+  for (unsigned i = 0; i < Repeat; ++i) {
+    Loops = 0;
+    Baseline += countAllocations(*M, BaselinePM);
+    Analysis += countAllocations(*M, AnalysisPM);
+  }
+
+  double Extra = static_cast<double>(Analysis) - Baseline;
+  outs() << "loops=" << Loops << ", runs=" << Repeat
+         << ", first run extra allocations=" << FirstRun
+         << ", baseline allocations=" << Baseline
+         << ", LoopInfoNA allocations=" << Analysis
+         << ", extra per loop="
+         << format("%.3f", Loops ? Extra / (Loops * Repeat) : 0.0) << '\n';
+
+  return 0;
+}
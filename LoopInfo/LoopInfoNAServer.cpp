@@ -0,0 +1,369 @@
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "LoopInfoNA.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+using namespace llvm;
+
+static cl::opt<std::string> SocketPath(cl::Positional, cl::Required,
+                                       cl::desc("<socket>"));
+
+namespace {
+// A parsed module along with the loops LoopInfoNA reported for it
+struct CachedModule {
+  // Hash of the file contents the module was parsed from
+  uint64_t Hash = 0;
+  std::unique_ptr<LLVMContext> Context;
+  std::unique_ptr<Module> M;
+
+  struct ReportedLoop {
+    int ID;
+    LoopRecord Record;
+    std::string Line;
+  };
+  std::vector<ReportedLoop> Loops;
+};
+
+// Keeps the modules and their analyses in memory between queries.
+// Modules are identified by their path and re-analysed when the hash
+// of the file contents changes.
+class ModuleCache {
+public:
+  // Get the module at Path, parsing and analysing it if it is not
+  // cached, if its contents changed or if Force is set
+  CachedModule *get(StringRef Path, bool Force, std::string &Error);
+
+  void forget(StringRef Path) { Modules.erase(Path); }
+
+  void list(raw_ostream &OS) const;
+
+private:
+  StringMap<CachedModule> Modules;
+};
+
+// Answers the queries of one connection, every query is a line and
+// every answer ends with a line that is either "ok" or "error: ..."
+class Session {
+public:
+  Session(ModuleCache &Cache, raw_ostream &OS) : Cache(Cache), OS(OS) {}
+
+  // Handle one query, returns false when the server has to stop
+  bool handle(StringRef Query);
+
+private:
+  void stats(ArrayRef<StringRef> Args);
+  void hottest(ArrayRef<StringRef> Args);
+  void reload(ArrayRef<StringRef> Args);
+  void help();
+  void fail(const Twine &Message);
+
+  ModuleCache &Cache;
+  raw_ostream &OS;
+};
+} // end of anonymous namespace
+
+CachedModule *ModuleCache::get(StringRef Path, bool Force,
+                               std::string &Error) {
+  auto Buffer = MemoryBuffer::getFile(Path);
+  if (!Buffer) {
+    Error = Buffer.getError().message();
+    return nullptr;
+  }
+
+  uint64_t Hash = xxHash64((*Buffer)->getBuffer());
+  auto It = Modules.find(Path);
+  if (It != Modules.end() && It->second.Hash == Hash && !Force) {
+    return &It->second;
+  }
+
+  CachedModule Entry;
+  Entry.Hash = Hash;
+  Entry.Context = std::make_unique<LLVMContext>();
+  SMDiagnostic Diagnostic;
+  Entry.M =
+      parseIR((*Buffer)->getMemBufferRef(), Diagnostic, *Entry.Context);
+  if (!Entry.M) {
+    raw_string_ostream ErrorOS(Error);
+    Diagnostic.print(nullptr, ErrorOS, false);
+    ErrorOS.flush();
+    Error = StringRef(Error).rtrim().str();
+    return nullptr;
+  }
+
+  legacy::PassManager PM;
+  PM.add(createLoopInfoNAPass(
+      [&Entry](int ID, const LoopRecord &Record, StringRef Line) {
+        // The IV widths are not used and do not outlive the call
+        Entry.Loops.push_back({ID, Record, Line.str()});
+        Entry.Loops.back().Record.IVWidths = None;
+      }));
+  PM.run(*Entry.M);
+
+  // The old module has to go before its context, which assigning over
+  // it would not guarantee
+  Modules.erase(Path);
+  return &Modules.try_emplace(Path, std::move(Entry)).first->second;
+}
+
+void ModuleCache::list(raw_ostream &OS) const {
+  for (const auto &Entry : Modules) {
+    OS << Entry.first() << ": loops=" << Entry.second.Loops.size()
+       << ", hash=" << format_hex(Entry.second.Hash, 18) << '\n';
+  }
+}
+
+bool Session::handle(StringRef Query) {
+  SmallVector<StringRef, 4> Args;
+  Query.split(Args, ' ', -1, false);
+  if (Args.empty()) {
+    return true;
+  }
+
+  StringRef Command = Args.front();
+  ArrayRef<StringRef> Rest = makeArrayRef(Args).drop_front();
+  if (Command == "stats") {
+    stats(Rest);
+  } else if (Command == "hottest") {
+    hottest(Rest);
+  } else if (Command == "reload") {
+    reload(Rest);
+  } else if (Command == "forget" && Rest.size() == 1) {
+    Cache.forget(Rest[0]);
+    OS << "ok\n";
+  } else if (Command == "list") {
+    Cache.list(OS);
+    OS << "ok\n";
+  } else if (Command == "shutdown") {
+    OS << "ok\n";
+    return false;
+  } else {
+    help();
+  }
+
+  return true;
+}
+
+void Session::stats(ArrayRef<StringRef> Args) {
+  if (Args.empty() || Args.size() > 2) {
+    return fail("usage: stats <module> [<function>]");
+  }
+
+  std::string Error;
+  CachedModule *Entry = Cache.get(Args[0], false, Error);
+  if (!Entry) {
+    return fail(Error);
+  }
+
+  for (const CachedModule::ReportedLoop &Loop : Entry->Loops) {
+    if (Args.size() == 1 || Loop.Record.Function == Args[1]) {
+      OS << Loop.Line << '\n';
+    }
+  }
+  OS << "ok\n";
+}
+
+void Session::hottest(ArrayRef<StringRef> Args) {
+  unsigned Count = 10;
+  if (Args.empty() || Args.size() > 3 ||
+      (Args.size() > 1 && Args[1].getAsInteger(10, Count))) {
+    return fail("usage: hottest <module> [<count>] [<metric>]");
+  }
+
+  std::string Error;
+  CachedModule *Entry = Cache.get(Args[0], false, Error);
+  if (!Entry) {
+    return fail(Error);
+  }
+
+  // Measured samples are the best measure of heat when a profile was
+  // given, the number of instructions otherwise
+  StringRef Metric = "instrs";
+  if (Args.size() > 2) {
+    Metric = Args[2];
+  } else if (any_of(Entry->Loops, [](const CachedModule::ReportedLoop &L) {
+               return L.Record.Samples != 0;
+             })) {
+    Metric = "samples";
+  }
+
+  using Getter = uint64_t (*)(const LoopRecord &);
+  Getter Get = StringSwitch<Getter>(Metric)
+                   .Case("samples",
+                         [](const LoopRecord &R) -> uint64_t {
+                           return R.Samples;
+                         })
+                   .Case("instrs",
+                         [](const LoopRecord &R) -> uint64_t {
+                           return R.Instructions;
+                         })
+                   .Case("BBs",
+                         [](const LoopRecord &R) -> uint64_t {
+                           return R.Blocks;
+                         })
+                   .Case("atomics",
+                         [](const LoopRecord &R) -> uint64_t {
+                           return R.Atomics;
+                         })
+                   .Case("branches",
+                         [](const LoopRecord &R) -> uint64_t {
+                           return R.Branches;
+                         })
+                   .Default(nullptr);
+  if (!Get) {
+    return fail("unknown metric '" + Metric + "'");
+  }
+
+  std::vector<const CachedModule::ReportedLoop *> Loops;
+  for (const CachedModule::ReportedLoop &Loop : Entry->Loops) {
+    Loops.push_back(&Loop);
+  }
+  std::stable_sort(Loops.begin(), Loops.end(),
+                   [&](const CachedModule::ReportedLoop *A,
+                       const CachedModule::ReportedLoop *B) {
+                     return Get(A->Record) > Get(B->Record);
+                   });
+
+  for (const CachedModule::ReportedLoop *Loop :
+       makeArrayRef(Loops).take_front(Count)) {
+    OS << Loop->Line << '\n';
+  }
+  OS << "ok\n";
+}
+
+void Session::reload(ArrayRef<StringRef> Args) {
+  if (Args.size() != 1) {
+    return fail("usage: reload <module>");
+  }
+
+  std::string Error;
+  CachedModule *Entry = Cache.get(Args[0], true, Error);
+  if (!Entry) {
+    return fail(Error);
+  }
+  OS << "loops=" << Entry->Loops.size() << "\nok\n";
+}
+
+void Session::help() {
+  OS << "stats <module> [<function>]    loops of a module or function\n"
+     << "hottest <module> [<n>] [<metric>]\n"
+     << "                               n loops with the highest metric\n"
+     << "reload <module>                analyse a module again\n"
+     << "forget <module>                drop a module from the cache\n"
+     << "list                           cached modules\n"
+     << "shutdown                       stop the server\n";
+  fail("unknown command");
+}
+
+void Session::fail(const Twine &Message) {
+  OS << "error: " << Message << '\n';
+}
+
+// Serve the connection of one client, returns false when the server
+// has to stop
+static bool serve(int Client, ModuleCache &Cache) {
+  raw_fd_ostream OS(Client, /*shouldClose=*/false, /*unbuffered=*/false);
+  Session S(Cache, OS);
+
+  std::string Pending;
+  char Chunk[4096];
+  while (true) {
+    ssize_t Read = read(Client, Chunk, sizeof(Chunk));
+    if (Read < 0 && errno == EINTR) {
+      continue;
+    }
+    if (Read <= 0) {
+      return true;
+    }
+    Pending.append(Chunk, Read);
+
+    size_t End;
+    while ((End = Pending.find('\n')) != std::string::npos) {
+      std::string Query = Pending.substr(0, End);
+      Pending.erase(0, End + 1);
+      bool KeepRunning = S.handle(StringRef(Query).trim());
+      OS.flush();
+      if (!KeepRunning) {
+        return false;
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(
+      argc, argv,
+      "LoopInfoNA server, keeps modules and their loop analyses in memory "
+      "and answers queries on a Unix socket\n");
+
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+
+  // A client going away while it is answered must not stop the server
+  signal(SIGPIPE, SIG_IGN);
+
+  sockaddr_un Address = {};
+  Address.sun_family = AF_UNIX;
+  if (SocketPath.size() >= sizeof(Address.sun_path)) {
+    errs() << "LoopInfoNA server: socket path too long\n";
+    return 1;
+  }
+  std::strcpy(Address.sun_path, SocketPath.c_str());
+
+  int Server = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(SocketPath.c_str());
+  if (Server < 0 ||
+      bind(Server, reinterpret_cast<sockaddr *>(&Address), sizeof(Address)) ||
+      listen(Server, 16)) {
+    errs() << "LoopInfoNA server: cannot listen on " << SocketPath << ": "
+           << std::strerror(errno) << '\n';
+    return 1;
+  }
+
+  ModuleCache Cache;
+  bool KeepRunning = true;
+  while (KeepRunning) {
+    int Client = accept(Server, nullptr, nullptr);
+    if (Client < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      errs() << "LoopInfoNA server: accept failed: " << std::strerror(errno)
+             << '\n';
+      break;
+    }
+
+    KeepRunning = serve(Client, Cache);
+    close(Client);
+  }
+
+  close(Server);
+  unlink(SocketPath.c_str());
+  return 0;
+}
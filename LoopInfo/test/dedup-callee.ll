@@ -0,0 +1,44 @@
+; Loops that only differ in the function they call must not share their
+; fingerprint, or deduplication reports the metrics of the first one.
+; RUN: opt -enable-new-pm=0 -load %shlibdir/LI_NA%shlibext -LoopInfoNA \
+; RUN:     -loopinfona-dedup -disable-output %s 2>&1 | FileCheck %s
+
+; CHECK: 0: func=f1,{{.*}} vectorInstrs=3,
+; CHECK: 1: func=f2,{{.*}} vectorInstrs=2,
+; CHECK-NOT: duplicateOf
+; CHECK: fingerprints: loops=2, unique=2, duplicated=0
+
+declare <4 x double> @llvm.sqrt.v4f64(<4 x double>)
+declare <4 x double> @foo(<4 x double>)
+
+define void @f1(<4 x double>* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %a = getelementptr <4 x double>, <4 x double>* %p, i32 %i
+  %v = load <4 x double>, <4 x double>* %a
+  %r = call <4 x double> @llvm.sqrt.v4f64(<4 x double> %v)
+  store <4 x double> %r, <4 x double>* %a
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret void
+}
+
+define void @f2(<4 x double>* %p, i32 %n) {
+entry:
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %a = getelementptr <4 x double>, <4 x double>* %p, i32 %i
+  %v = load <4 x double>, <4 x double>* %a
+  %r = call <4 x double> @foo(<4 x double> %v)
+  store <4 x double> %r, <4 x double>* %a
+  %i.next = add i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit
+exit:
+  ret void
+}
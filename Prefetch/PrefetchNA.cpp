@@ -0,0 +1,352 @@
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
+
+using namespace llvm;
+
+static cl::opt<unsigned>
+    Distance("prefetchna-distance", cl::init(8),
+             cl::desc("Number of iterations ahead that data is "
+                      "prefetched"));
+
+static cl::opt<unsigned>
+    CacheLevel("prefetchna-cache-level", cl::init(1),
+               cl::desc("Cache level data is prefetched into, from 1 to "
+                        "3, or 0 for a non-temporal prefetch"));
+
+static cl::opt<unsigned>
+    LineSize("prefetchna-line-size", cl::init(64),
+             cl::desc("Cache line size, accesses closer than that share "
+                      "a prefetch"));
+
+namespace {
+// A memory access of the loop a prefetch was inserted for
+struct Prefetch {
+  Instruction *Access;
+  // Whether its address is loaded in the loop rather than strided
+  bool Indirect;
+};
+
+// Collects the loads of a loop an expression depends on
+struct LoadCollector {
+  const Loop *L;
+  SmallVector<LoadInst *, 2> Loads;
+
+  explicit LoadCollector(const Loop *L) : L(L) {}
+
+  bool follow(const SCEV *S) {
+    const auto *Unknown = dyn_cast<SCEVUnknown>(S);
+    auto *LI = Unknown ? dyn_cast<LoadInst>(Unknown->getValue()) : nullptr;
+    if (LI && L->contains(LI) && !is_contained(Loads, LI)) {
+      Loads.push_back(LI);
+    }
+    return true;
+  }
+
+  bool isDone() const { return false; }
+};
+
+class PrefetchNA : public LoopPass {
+public:
+  static char ID;
+
+  PrefetchNA();
+  void getAnalysisUsage(AnalysisUsage &AU) const override;
+  bool runOnLoop(Loop *L, LPPassManager &LPM) override;
+
+private:
+  // Insert prefetches for the strided and indirect accesses of the
+  // loop and return true if any was inserted
+  bool insertPrefetches(Loop *L, SmallVectorImpl<Prefetch> &Prefetches) const;
+
+  // Get the address an access reads or writes, null if it is not a
+  // simple load or store
+  Value *getAddress(Instruction &I) const;
+
+  // Check if a strided address is within a cache line of one that is
+  // already prefetched
+  bool isCovered(const SCEVAddRecExpr *Address,
+                 ArrayRef<const SCEVAddRecExpr *> Prefetched,
+                 ScalarEvolution *SE) const;
+
+  // Get the address of an indirect access, a[b[i]], Distance
+  // iterations ahead. The load of b[i] is repeated that many iterations
+  // ahead too, clamped to the last iteration so that it cannot fault.
+  // Returns null if the address is not of that form.
+  Value *getIndirectAddress(Loop *L, const SCEV *Address, Instruction *I,
+                            SCEVExpander &Expander) const;
+
+  // Get the load of the index of an indirect access, the only load of
+  // the loop its address depends on, if it is strided and runs in every
+  // iteration
+  LoadInst *getIndexLoad(Loop *L, const SCEV *Address) const;
+
+  // Insert a call to llvm.prefetch for an address before an access
+  void emitPrefetch(Value *Address, Instruction *I) const;
+
+  // Print all the accesses that were prefetched
+  void print(const SmallVectorImpl<Prefetch> &Prefetches) const;
+
+  // Emit an optimization remark for every prefetched access so that
+  // they can be collected with -pass-remarks-output
+  void emitRemarks(Loop *L, const SmallVectorImpl<Prefetch> &Prefetches) const;
+}; // end of class PrefetchNA
+
+} // end of anonymous namespace
+
+char PrefetchNA::ID = 0;
+
+static RegisterPass<PrefetchNA> X("PrefetchNA", "PrefetchNA Pass",
+                                  false /* Only looks at CFG */,
+                                  false /* Analysis Pass */);
+
+PrefetchNA::PrefetchNA() : LoopPass(ID) {
+  if (CacheLevel > 3) {
+    report_fatal_error("PrefetchNA: the cache level must be from 0 to 3",
+                       false);
+  }
+}
+
+void PrefetchNA::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesCFG();
+  AU.addRequiredID(LoopSimplifyID);
+  AU.addRequired<LoopInfoWrapperPass>();
+  AU.addRequired<DominatorTreeWrapperPass>();
+  AU.addRequired<ScalarEvolutionWrapperPass>();
+  AU.addRequired<OptimizationRemarkEmitterWrapperPass>();
+}
+
+bool PrefetchNA::runOnLoop(Loop *L, LPPassManager &LPM) {
+  // Outer loops spend their time in their inner loops, which get their
+  // own prefetches
+  if (!L->isInnermost() || Distance == 0) {
+    return false;
+  }
+
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  unsigned MaxTripCount = SE->getSmallConstantMaxTripCount(L);
+  if (MaxTripCount && MaxTripCount <= Distance) {
+    return false;
+  }
+
+  SmallVector<Prefetch, 8> Prefetches;
+  bool Modified = insertPrefetches(L, Prefetches);
+  print(Prefetches);
+  emitRemarks(L, Prefetches);
+
+  return Modified;
+}
+
+bool PrefetchNA::insertPrefetches(
+    Loop *L, SmallVectorImpl<Prefetch> &Prefetches) const {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  const DataLayout &DL = L->getHeader()->getModule()->getDataLayout();
+  SCEVExpander Expander(*SE, DL, "prefetch");
+
+  // Collect the accesses first, since expanding addresses adds
+  // instructions to the loop
+  SmallVector<Instruction *, 16> Accesses;
+  for (BasicBlock *BB : L->blocks()) {
+    for (Instruction &I : *BB) {
+      if (getAddress(I)) {
+        Accesses.push_back(&I);
+      }
+    }
+  }
+
+  SmallVector<const SCEVAddRecExpr *, 8> Strided;
+  SmallVector<const SCEV *, 8> Indirect;
+  for (Instruction *I : Accesses) {
+    const SCEV *Address = SE->getSCEV(getAddress(*I));
+
+    const auto *AddRec = dyn_cast<SCEVAddRecExpr>(Address);
+    if (AddRec && AddRec->getLoop() == L && AddRec->isAffine()) {
+      const SCEV *Step = AddRec->getStepRecurrence(*SE);
+      if (Step->isZero() || !SE->isLoopInvariant(Step, L) ||
+          isCovered(AddRec, Strided, SE)) {
+        continue;
+      }
+      Strided.push_back(AddRec);
+
+      const SCEV *Ahead = SE->getAddExpr(
+          AddRec, SE->getMulExpr(SE->getConstant(Step->getType(), Distance),
+                                 Step));
+      emitPrefetch(Expander.expandCodeFor(Ahead, Address->getType(), I), I);
+      Prefetches.push_back({I, false});
+      continue;
+    }
+
+    if (SE->isLoopInvariant(Address, L) || is_contained(Indirect, Address)) {
+      continue;
+    }
+    if (Value *Ahead = getIndirectAddress(L, Address, I, Expander)) {
+      Indirect.push_back(Address);
+      emitPrefetch(Ahead, I);
+      Prefetches.push_back({I, true});
+    }
+  }
+
+  return !Prefetches.empty();
+}
+
+Value *PrefetchNA::getAddress(Instruction &I) const {
+  if (auto *LI = dyn_cast<LoadInst>(&I)) {
+    return LI->isSimple() ? LI->getPointerOperand() : nullptr;
+  }
+  if (auto *SI = dyn_cast<StoreInst>(&I)) {
+    return SI->isSimple() ? SI->getPointerOperand() : nullptr;
+  }
+
+  return nullptr;
+}
+
+bool PrefetchNA::isCovered(const SCEVAddRecExpr *Address,
+                           ArrayRef<const SCEVAddRecExpr *> Prefetched,
+                           ScalarEvolution *SE) const {
+  for (const SCEVAddRecExpr *Other : Prefetched) {
+    if (Other->getType() != Address->getType() ||
+        Other->getStepRecurrence(*SE) != Address->getStepRecurrence(*SE)) {
+      continue;
+    }
+
+    const auto *Offset =
+        dyn_cast<SCEVConstant>(SE->getMinusSCEV(Address, Other));
+    if (Offset && Offset->getAPInt().abs().ult(LineSize)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+Value *PrefetchNA::getIndirectAddress(Loop *L, const SCEV *Address,
+                                      Instruction *I,
+                                      SCEVExpander &Expander) const {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+
+  LoadInst *Index = getIndexLoad(L, Address);
+  const SCEV *BackedgeTakenCount = SE->getBackedgeTakenCount(L);
+  if (!Index || isa<SCEVCouldNotCompute>(BackedgeTakenCount)) {
+    return nullptr;
+  }
+
+  // Everything but the index has to be invariant
+  ValueToSCEVMapTy Map;
+  Map[Index] = SE->getSCEV(Constant::getNullValue(Index->getType()));
+  if (!SE->isLoopInvariant(SCEVParameterRewriter::rewrite(Address, *SE, Map),
+                           L)) {
+    return nullptr;
+  }
+
+  const auto *IndexAddress =
+      cast<SCEVAddRecExpr>(SE->getSCEV(Index->getPointerOperand()));
+  const SCEV *Step = IndexAddress->getStepRecurrence(*SE);
+  Type *CountTy = BackedgeTakenCount->getType();
+  const SCEV *Iteration = SE->getUMinExpr(
+      SE->getAddRecExpr(SE->getConstant(CountTy, Distance),
+                        SE->getOne(CountTy), L, SCEV::FlagAnyWrap),
+      BackedgeTakenCount);
+  const SCEV *IndexAhead = SE->getAddExpr(
+      IndexAddress->getStart(),
+      SE->getMulExpr(Step,
+                     SE->getTruncateOrZeroExtend(Iteration, Step->getType())));
+
+  Value *IndexAddressAhead =
+      Expander.expandCodeFor(IndexAhead, Index->getPointerOperandType(), I);
+  auto *IndexAheadLoad =
+      new LoadInst(Index->getType(), IndexAddressAhead, "prefetch.index",
+                   false, Index->getAlign(), I);
+
+  Map[Index] = SE->getUnknown(IndexAheadLoad);
+  return Expander.expandCodeFor(SCEVParameterRewriter::rewrite(Address, *SE,
+                                                               Map),
+                                Address->getType(), I);
+}
+
+LoadInst *PrefetchNA::getIndexLoad(Loop *L, const SCEV *Address) const {
+  ScalarEvolution *SE = &getAnalysis<ScalarEvolutionWrapperPass>().getSE();
+  DominatorTree *DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+
+  LoadCollector Loads(L);
+  visitAll(Address, Loads);
+  if (Loads.Loads.size() != 1 || !Loads.Loads[0]->isSimple()) {
+    return nullptr;
+  }
+  LoadInst *Index = Loads.Loads[0];
+
+  const auto *IndexAddress =
+      dyn_cast<SCEVAddRecExpr>(SE->getSCEV(Index->getPointerOperand()));
+  if (!IndexAddress || IndexAddress->getLoop() != L ||
+      !IndexAddress->isAffine() ||
+      !SE->isLoopInvariant(IndexAddress->getStepRecurrence(*SE), L)) {
+    return nullptr;
+  }
+
+  // The index is only read ahead where the loop reads it, which needs
+  // the load to run in every iteration, also the last one
+  SmallVector<BasicBlock *, 4> Exiting;
+  L->getExitingBlocks(Exiting);
+  bool EveryIteration = all_of(Exiting, [&](const BasicBlock *BB) {
+    return DT->dominates(Index->getParent(), BB);
+  });
+
+  return EveryIteration ? Index : nullptr;
+}
+
+void PrefetchNA::emitPrefetch(Value *Address, Instruction *I) const {
+  IRBuilder<> Builder(I);
+  Module *M = I->getModule();
+  Type *I8Ptr = Builder.getInt8PtrTy(
+      cast<PointerType>(Address->getType())->getAddressSpace());
+  Function *PrefetchFunc =
+      Intrinsic::getDeclaration(M, Intrinsic::prefetch, I8Ptr);
+
+  unsigned Locality = CacheLevel ? 4 - CacheLevel : 0;
+  Builder.CreateCall(PrefetchFunc,
+                     {Builder.CreatePointerCast(Address, I8Ptr),
+                      Builder.getInt32(isa<StoreInst>(I)),
+                      Builder.getInt32(Locality), Builder.getInt32(1)});
+}
+
+void PrefetchNA::print(const SmallVectorImpl<Prefetch> &Prefetches) const {
+  for (const Prefetch &P : Prefetches) {
+    P.Access->print(errs());
+    errs() << (P.Indirect ? " (indirect)" : "") << '\n';
+  }
+}
+
+void PrefetchNA::emitRemarks(
+    Loop *L, const SmallVectorImpl<Prefetch> &Prefetches) const {
+  OptimizationRemarkEmitter *ORE =
+      &getAnalysis<OptimizationRemarkEmitterWrapperPass>().getORE();
+
+  for (const Prefetch &P : Prefetches) {
+    ORE->emit([&]() {
+      return OptimizationRemark("PrefetchNA", "Prefetched", P.Access)
+             << (P.Indirect ? "indirect" : "strided")
+             << " access prefetched "
+             << ore::NV("Distance", static_cast<unsigned>(Distance))
+             << " iterations ahead in loop with header "
+             << ore::NV("Header", L->getHeader()->getName());
+    });
+  }
+}